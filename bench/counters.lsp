@@ -0,0 +1,8 @@
+; Allocates a closure per iteration, so the collector has work to do.
+(lambda (N)
+    (let (make-adder (lambda (k) (lambda (x) (+ x k)))
+        loop (lambda (i total)
+            (if (= i 0)
+                total
+                (loop (- i 1) ((make-adder i) total)))))
+        (loop (str-to-num (prog-arg 1)) 0)))
@@ -0,0 +1,7 @@
+; Naive doubly recursive fibonacci, mostly calls and arithmetic.
+(lambda (N)
+    (let (fib (lambda (n)
+        (if (< n 2)
+            n
+            (+ (fib (- n 1)) (fib (- n 2))))))
+        (fib (str-to-num (prog-arg 1)))))
@@ -0,0 +1,8 @@
+; Recursion ten thousand calls deep that is not in tail position.
+(lambda (N)
+    (let (sum (lambda (n) (if (= n 0) 0 (+ n (sum (- n 1)))))
+        repeat (lambda (i total)
+            (if (= i 0)
+                total
+                (repeat (- i 1) (+ total (sum 10000))))))
+        (repeat (str-to-num (prog-arg 1)) 0)))
@@ -0,0 +1,8 @@
+; Builds a string a number at a time, keeping the last thousand bytes.
+(lambda (N)
+    (let (keep (lambda (s) (if (< (str-len s) 1000) s (str-sub s (- (str-len s) 1000) 1000)))
+        build (lambda (i s)
+            (if (= i 0)
+                s
+                (build (- i 1) (str-cat (keep s) (num-to-str i))))))
+        (str-len (build (str-to-num (prog-arg 1)) ""))))
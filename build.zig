@@ -15,12 +15,17 @@ pub fn build(b: *std.Build) void {
     // set a preferred release mode, allowing the user to decide how to optimize.
     const optimize = b.standardOptimizeOption(.{});
 
-    // const support = b.addStaticLibrary(.{
-    //     .name = "LOLFramework",
-    //     .root_source_file = .{ .path = "src/support.zig" },
-    //     .target = target,
-    //     .optimize = optimize,
-    // });
+    // The runtime of compiled programs. The compiler embeds the same
+    // sources for its own -o mode, this is for linking by hand.
+    const support = b.addStaticLibrary(.{
+        .name = "LOLFramework",
+        .target = target,
+        .optimize = optimize,
+    });
+    support.addCSourceFile(.{ .file = .{ .path = "src/support.c" }, .flags = &.{"-O2"} });
+    support.addIncludePath(.{ .path = "src" });
+    support.linkLibC();
+    support.installHeader("src/support.h", "support.h");
 
     const support_unit_tests = b.addTest(.{
         .root_source_file = .{ .path = "src/support.zig" },
@@ -29,6 +34,10 @@ pub fn build(b: *std.Build) void {
     });
     support_unit_tests.linkLibC();
     support_unit_tests.addIncludePath(.{ .path = "src" });
+    support_unit_tests.addCSourceFile(.{
+        .file = .{ .path = "src/support.c" },
+        .flags = &.{"-DSUPPORT_IGNORE_FATAL_ERRORS=1"},
+    });
 
     const exe = b.addExecutable(.{
         .name = "LispOriginatingLanguage",
@@ -38,13 +47,18 @@ pub fn build(b: *std.Build) void {
         .target = target,
         .optimize = optimize,
     });
-    //exe.step.dependOn(&support.step);
+    // The interpreter runs programs on the same runtime as generated code.
+    exe.linkLibC();
+    exe.addIncludePath(.{ .path = "src" });
+    exe.addCSourceFile(.{ .file = .{ .path = "src/support.c" }, .flags = &.{"-O2"} });
+    // Lambdas compiled by --jit link against the runtime in the executable.
+    exe.rdynamic = true;
 
     // This declares intent for the executable to be installed into the
     // standard location when the user invokes the "install" step (the default
     // step when running `zig build`).
     b.installArtifact(exe);
-    //b.installArtifact(support);
+    b.installArtifact(support);
 
     // This *creates* a Run step in the build graph, to be executed when another
     // step is evaluated that depends on it. The next line below will establish
@@ -76,6 +90,11 @@ pub fn build(b: *std.Build) void {
         .target = target,
         .optimize = optimize,
     });
+    unit_tests.linkLibC();
+    unit_tests.addIncludePath(.{ .path = "src" });
+    unit_tests.addCSourceFile(.{ .file = .{ .path = "src/support.c" }, .flags = &.{"-O2"} });
+    // The --jit test loads lambdas that link against the runtime in it.
+    unit_tests.rdynamic = true;
 
     const run_unit_tests = b.addRunArtifact(unit_tests);
     const run_support_unit_tests = b.addRunArtifact(support_unit_tests);
@@ -86,4 +105,24 @@ pub fn build(b: *std.Build) void {
     const test_step = b.step("test", "Run unit tests");
     test_step.dependOn(&run_unit_tests.step);
     test_step.dependOn(&run_support_unit_tests.step);
+
+    // The benchmarks are built optimized no matter what was asked for, runs
+    // like `zig build bench > bench.json` are only comparable that way.
+    const bench = b.addExecutable(.{
+        .name = "bench",
+        .root_source_file = .{ .path = "src/bench.zig" },
+        .target = target,
+        .optimize = .ReleaseFast,
+    });
+    bench.linkLibC();
+    bench.addIncludePath(.{ .path = "src" });
+    bench.addCSourceFile(.{ .file = .{ .path = "src/support.c" }, .flags = &.{"-O2"} });
+
+    const bench_cmd = b.addRunArtifact(bench);
+    bench_cmd.addArgs(&.{ b.pathFromRoot("bench"), b.getInstallPath(.prefix, "bench") });
+    // The results depend on the machine, they are never cached.
+    bench_cmd.has_side_effects = true;
+
+    const bench_step = b.step("bench", "Run the compiler and runtime benchmarks");
+    bench_step.dependOn(&bench_cmd.step);
 }
@@ -0,0 +1,225 @@
+//! This file contains the benchmarks run by `zig build bench`. It takes the
+//! directory of the runtime benchmarks and where to build them, and prints
+//! the results as JSON to stdout.
+
+const std = @import("std");
+const lol = @import("main.zig");
+
+/// A synthetic program written by `generate`, with `count` setting its size.
+const CompileBenchmark = struct {
+    name: []const u8,
+    count: usize,
+    generate: *const fn (writer: std.ArrayList(u8).Writer, count: usize) anyerror!void,
+};
+
+/// A program in the benchmark directory, run with `args`.
+const RunBenchmark = struct {
+    name: []const u8,
+    args: []const []const u8,
+};
+
+const compile_benchmarks = [_]CompileBenchmark{
+    .{ .name = "many_forms", .count = 2000, .generate = generateManyForms },
+    .{ .name = "many_bindings", .count = 5000, .generate = generateManyBindings },
+    .{ .name = "nested_lets", .count = 2000, .generate = generateNestedLets },
+    .{ .name = "many_lambdas", .count = 1000, .generate = generateManyLambdas },
+    .{ .name = "string_literals", .count = 5000, .generate = generateStringLiterals },
+};
+
+const run_benchmarks = [_]RunBenchmark{
+    .{ .name = "fib", .args = &.{"32"} },
+    .{ .name = "counters", .args = &.{"10000000"} },
+    .{ .name = "strings", .args = &.{"1000000"} },
+    .{ .name = "recursion", .args = &.{"1000"} },
+};
+
+/// Each benchmark is repeated this many times and the fastest run reported.
+const iterations = 5;
+
+const PhaseResult = struct {
+    phase: []const u8,
+    nanoseconds: u64,
+    bytes: usize,
+};
+
+const CompileResult = struct {
+    name: []const u8,
+    source_bytes: usize,
+    nanoseconds: u64,
+    phases: []PhaseResult,
+};
+
+const RunResult = struct {
+    name: []const u8,
+    args: []const []const u8,
+    nanoseconds: u64,
+    exit_code: u8,
+};
+
+const Report = struct {
+    compile: []CompileResult,
+    run: []RunResult,
+};
+
+fn generateManyForms(writer: std.ArrayList(u8).Writer, count: usize) anyerror!void {
+    for (0..count) |i| {
+        try writer.print("(lambda (N) (let (f (lambda (x y) (+ x (- y 1)))) (f N {d})))\n", .{i});
+    }
+}
+
+fn generateManyBindings(writer: std.ArrayList(u8).Writer, count: usize) anyerror!void {
+    try writer.writeAll("(lambda (N) (let (v0 N\n");
+    for (1..count) |i| {
+        try writer.print("    v{d} (+ v{d} {d})\n", .{ i, i - 1, i });
+    }
+    try writer.print(") v{d}))\n", .{count - 1});
+}
+
+/// Every let refers to the binding of the one around it, the scopes the
+/// resolver keeps are as deep as `count`.
+fn generateNestedLets(writer: std.ArrayList(u8).Writer, count: usize) anyerror!void {
+    try writer.writeAll("(lambda (N) (let (v0 N)\n");
+    for (1..count) |i| {
+        try writer.print("(let (v{d} (+ v{d} 1))\n", .{ i, i - 1 });
+    }
+    try writer.print("v{d}", .{count - 1});
+    for (0..count) |_| {
+        try writer.writeAll(")");
+    }
+    try writer.writeAll(")\n");
+}
+
+fn generateManyLambdas(writer: std.ArrayList(u8).Writer, count: usize) anyerror!void {
+    try writer.writeAll("(lambda (N) (let (f0 (lambda (x) x)\n");
+    for (1..count) |i| {
+        try writer.print("    f{d} (lambda (x) (if (< x {d}) (f{d} (+ x 1)) x))\n", .{ i, i, i - 1 });
+    }
+    try writer.print(") (f{d} N)))\n", .{count - 1});
+}
+
+fn generateStringLiterals(writer: std.ArrayList(u8).Writer, count: usize) anyerror!void {
+    for (0..count) |i| {
+        try writer.print("(lambda (N) (str-len (str-cat \"string {d}\" \"\\t\\\"escaped\\\" {d}\\n\")))\n", .{ i, i });
+    }
+}
+
+/// Compiles `source` the way the compiler does for -o, without running the
+/// C compiler, and returns the statistics of every phase.
+fn compile(driver: *lol.Driver, pool: *std.Thread.Pool, source: []const u8) !lol.PhaseStats {
+    var stats = lol.PhaseStats{};
+    var program_arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer program_arena.deinit();
+    var program_counter = lol.CountingAllocator{ .child = program_arena.allocator(), .stats = &stats };
+    var form_arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer form_arena.deinit();
+    var form_counter = lol.CountingAllocator{ .child = form_arena.allocator(), .stats = &stats };
+
+    var c_file = try driver.createSource();
+    defer c_file.close();
+    var c_writer = std.io.BufferedWriter(1 << 16, std.fs.File.Writer){ .unbuffered_writer = c_file.writer() };
+    var compiler = try lol.Compiler.init(program_counter.allocator(), source, c_writer.writer(), &stats);
+    compiler.pool = pool;
+    try compiler.compileProgram(&form_arena, form_counter.allocator());
+    try c_writer.flush();
+    return stats;
+}
+
+fn totalNanoseconds(stats: *lol.PhaseStats) u64 {
+    var total: u64 = 0;
+    for (std.enums.values(lol.Phase)) |phase| {
+        total += stats.nanoseconds.get(phase);
+    }
+    return total;
+}
+
+fn runCompileBenchmark(allocator: std.mem.Allocator, driver: *lol.Driver, pool: *std.Thread.Pool, benchmark: CompileBenchmark) !CompileResult {
+    var source = std.ArrayList(u8).init(allocator);
+    try benchmark.generate(source.writer(), benchmark.count);
+
+    var best: ?lol.PhaseStats = null;
+    for (0..iterations) |_| {
+        var stats = try compile(driver, pool, source.items);
+        if (best == null or totalNanoseconds(&stats) < totalNanoseconds(&best.?)) {
+            best = stats;
+        }
+    }
+    var phases = std.ArrayList(PhaseResult).init(allocator);
+    for (std.enums.values(lol.Phase)) |phase| {
+        try phases.append(.{
+            .phase = @tagName(phase),
+            .nanoseconds = best.?.nanoseconds.get(phase),
+            .bytes = best.?.bytes.get(phase),
+        });
+    }
+    return CompileResult{
+        .name = benchmark.name,
+        .source_bytes = source.items.len,
+        .nanoseconds = totalNanoseconds(&best.?),
+        .phases = phases.items,
+    };
+}
+
+fn runRunBenchmark(allocator: std.mem.Allocator, driver: *lol.Driver, pool: *std.Thread.Pool, directory: []const u8, output_directory: []const u8, benchmark: RunBenchmark) !RunResult {
+    var path = try std.fmt.allocPrint(allocator, "{s}/{s}.lsp", .{ directory, benchmark.name });
+    var source = try std.fs.cwd().readFileAlloc(allocator, path, std.math.maxInt(u32));
+    _ = try compile(driver, pool, source);
+    var exe = try std.fs.path.join(allocator, &.{ output_directory, benchmark.name });
+    try driver.build(exe);
+
+    var argv = std.ArrayList([]const u8).init(allocator);
+    try argv.append(exe);
+    try argv.appendSlice(benchmark.args);
+    var best: u64 = std.math.maxInt(u64);
+    var exit_code: u8 = 0;
+    for (0..iterations) |_| {
+        var child = std.ChildProcess.init(argv.items, allocator);
+        child.stdout_behavior = .Ignore;
+        var timer = try std.time.Timer.start();
+        var term = try child.spawnAndWait();
+        var elapsed = timer.read();
+        if (term != .Exited) {
+            std.debug.print("{s} did not exit: {any}\n", .{ benchmark.name, term });
+            return error.BenchmarkCrashed;
+        }
+        exit_code = term.Exited;
+        best = @min(best, elapsed);
+    }
+    return RunResult{
+        .name = benchmark.name,
+        .args = benchmark.args,
+        .nanoseconds = best,
+        .exit_code = exit_code,
+    };
+}
+
+pub fn main() !void {
+    var arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+
+    var args = try std.process.argsAlloc(allocator);
+    var directory: []const u8 = if (args.len > 1) args[1] else "bench";
+    var output_directory: []const u8 = if (args.len > 2) args[2] else "zig-out/bench";
+    try std.fs.cwd().makePath(output_directory);
+
+    var driver = try lol.Driver.init(allocator);
+    var pool_allocator = std.heap.ThreadSafeAllocator{ .child_allocator = allocator };
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = pool_allocator.allocator() });
+    defer pool.deinit();
+
+    var compile_results = std.ArrayList(CompileResult).init(allocator);
+    for (compile_benchmarks) |benchmark| {
+        try compile_results.append(try runCompileBenchmark(allocator, &driver, &pool, benchmark));
+    }
+    var run_results = std.ArrayList(RunResult).init(allocator);
+    for (run_benchmarks) |benchmark| {
+        try run_results.append(try runRunBenchmark(allocator, &driver, &pool, directory, output_directory, benchmark));
+    }
+
+    var stdout = std.io.bufferedWriter(std.io.getStdOut().writer());
+    var report = Report{ .compile = compile_results.items, .run = run_results.items };
+    try std.json.stringify(report, .{ .whitespace = .indent_2 }, stdout.writer());
+    try stdout.writer().writeAll("\n");
+    try stdout.flush();
+}
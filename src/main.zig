@@ -1,4 +1,8 @@
 const std = @import("std");
+const builtin = @import("builtin");
+const support = @cImport({
+    @cInclude("support.h");
+});
 
 const TokenTag = enum {
     none,
@@ -10,19 +14,15 @@ const TokenTag = enum {
 
 const Token = struct {
     index: u32,
+    len: u32,
     tag: TokenTag,
+    /// The interned symbol for symbol tokens. String tokens are interned
+    /// with their quotes, so equal literals share an id too.
+    symbol: u32,
 };
 const Tokens = std.MultiArrayList(Token);
 
-const TokenizerState = enum {
-    normal,
-    symbol,
-    string,
-    comment,
-    escape_string,
-};
-
-const TokenizerError = error{unexpected_char};
+const TokenizerError = error{ unexpected_char, unterminated_string };
 
 fn isSymbolToken(c: u8) bool {
     return switch(c) {
@@ -31,170 +31,360 @@ fn isSymbolToken(c: u8) bool {
     };
 }
 
+/// A builtin procedure provided by the support header.
+const Builtin = struct {
+    name: []const u8,
+    c_name: []const u8,
+    /// The C operator used when a call to the builtin is emitted inline.
+    operator: ?[]const u8 = null,
+    /// Computes the result of a call on constants, see foldConstants.
+    fold: ?*const fn (i64, i64) i64 = null,
+};
+
+fn foldAdd(a: i64, b: i64) i64 {
+    return a +% b;
+}
+fn foldSubtract(a: i64, b: i64) i64 {
+    return a -% b;
+}
+fn foldEquals(a: i64, b: i64) i64 {
+    return @intFromBool(a == b);
+}
+fn foldBitwiseOr(a: i64, b: i64) i64 {
+    return a | b;
+}
+fn foldBitwiseAnd(a: i64, b: i64) i64 {
+    return a & b;
+}
+fn foldLessThan(a: i64, b: i64) i64 {
+    return @intFromBool(a < b);
+}
+
+const builtins = [_]Builtin{
+    .{ .name = "+", .c_name = "sup_builtin_add", .operator = "+", .fold = foldAdd },
+    .{ .name = "-", .c_name = "sup_builtin_subtract", .operator = "-", .fold = foldSubtract },
+    .{ .name = "=", .c_name = "sup_builtin_equals", .operator = "==", .fold = foldEquals },
+    .{ .name = "or", .c_name = "sup_builtin_bitwise_or", .operator = "|", .fold = foldBitwiseOr },
+    .{ .name = "and", .c_name = "sup_builtin_bitwise_and", .operator = "&", .fold = foldBitwiseAnd },
+    .{ .name = "<", .c_name = "sup_builtin_less_than", .operator = "<", .fold = foldLessThan },
+    .{ .name = "prog-arg", .c_name = "sup_builtin_program_argument" },
+    .{ .name = "str-to-num", .c_name = "sup_builtin_string_to_number" },
+    .{ .name = "num-to-str", .c_name = "sup_builtin_number_to_string" },
+    .{ .name = "put-str", .c_name = "sup_builtin_put_string" },
+    .{ .name = "flush", .c_name = "sup_builtin_flush" },
+    .{ .name = "str-len", .c_name = "sup_builtin_string_length" },
+    .{ .name = "str-cat", .c_name = "sup_builtin_string_concat" },
+    .{ .name = "str-sub", .c_name = "sup_builtin_substring" },
+    .{ .name = "str-cmp", .c_name = "sup_builtin_string_compare" },
+};
+
+// The keywords and builtins are interned first, so their ids are known
+// up front.
+const symbol_lambda: u32 = 0;
+const symbol_if: u32 = 1;
+const symbol_let: u32 = 2;
+const first_builtin_symbol: u32 = 3;
+
+fn builtinOf(symbol: u32) ?*const Builtin {
+    if (symbol < first_builtin_symbol or symbol - first_builtin_symbol >= builtins.len) {
+        return null;
+    }
+    return &builtins[symbol - first_builtin_symbol];
+}
+
+/// Maps every distinct symbol to a small integer id.
+const SymbolTable = struct {
+    allocator: std.mem.Allocator,
+    ids: std.StringHashMapUnmanaged(u32),
+    names: std.ArrayListUnmanaged([]const u8),
+
+    fn init(allocator: std.mem.Allocator) !SymbolTable {
+        var table = SymbolTable{
+            .allocator = allocator,
+            .ids = .{},
+            .names = .{},
+        };
+        for ([_][]const u8{ "lambda", "if", "let" }) |keyword| {
+            _ = try table.intern(keyword);
+        }
+        for (builtins) |b| {
+            _ = try table.intern(b.name);
+        }
+        return table;
+    }
+
+    fn intern(self: *SymbolTable, text: []const u8) !u32 {
+        // Names point into the source, which outlives the table.
+        var entry = try self.ids.getOrPut(self.allocator, text);
+        if (!entry.found_existing) {
+            entry.value_ptr.* = @intCast(self.names.items.len);
+            try self.names.append(self.allocator, text);
+        }
+        return entry.value_ptr.*;
+    }
+
+    fn nameOf(self: *const SymbolTable, symbol: u32) []const u8 {
+        return self.names.items[symbol];
+    }
+
+    fn count(self: *const SymbolTable) u32 {
+        return @intCast(self.names.items.len);
+    }
+};
+
+const simd_width = 16;
+const Chunk = @Vector(simd_width, u8);
+
+/// Sets the bytes of `chunk` that are in `lo...hi` to one and the rest to zero.
+fn chunkInRange(chunk: Chunk, comptime lo: u8, comptime hi: u8) Chunk {
+    const offset: Chunk = @splat(lo);
+    const limit: Chunk = @splat(hi - lo + 1);
+    return @select(u8, chunk -% offset < limit, @as(Chunk, @splat(1)), @as(Chunk, @splat(0)));
+}
+
+/// Returns the index of the first byte at or after `start` that cannot be
+/// part of a symbol, see isSymbolToken.
+fn symbolEnd(source: []const u8, start: usize) usize {
+    var i = start;
+    while (i + simd_width <= source.len) : (i += simd_width) {
+        const chunk: Chunk = source[i..][0..simd_width].*;
+        // Setting bit 5 maps upper case letters to lower case ones and
+        // leaves digits as they are.
+        const folded = chunk | @as(Chunk, @splat(0x20));
+        const symbol = chunkInRange(folded, 'a', 'z') |
+            chunkInRange(chunk, '0', '9') |
+            chunkInRange(chunk, '<', '=') |
+            chunkInRange(chunk, '+', '+') |
+            chunkInRange(chunk, '-', '-');
+        if (std.simd.firstTrue(symbol == @as(Chunk, @splat(0)))) |offset| {
+            return i + offset;
+        }
+    }
+    while (i < source.len and isSymbolToken(source[i])) {
+        i += 1;
+    }
+    return i;
+}
+
+/// Returns the index of the line break that ends the comment at `start`.
+fn commentEnd(source: []const u8, start: usize) usize {
+    var i = start;
+    while (i + simd_width <= source.len) : (i += simd_width) {
+        const chunk: Chunk = source[i..][0..simd_width].*;
+        const line_break = chunkInRange(chunk, '\n', '\n') | chunkInRange(chunk, '\r', '\r');
+        if (std.simd.firstTrue(line_break != @as(Chunk, @splat(0)))) |offset| {
+            return i + offset;
+        }
+    }
+    while (i < source.len and source[i] != '\n' and source[i] != '\r') {
+        i += 1;
+    }
+    return i;
+}
+
 const Tokenizer = struct {
+    /// Where tokenizing stopped, used to report errors.
     index: u32,
-    state: TokenizerState,
+    /// Holds the tokens, see nextForm.
     allocator: std.mem.Allocator,
     tokens: Tokens,
-    source: std.ArrayList(u8),
-    fn addToken(self: *Tokenizer, comptime t: TokenTag) !void {
+    source: []const u8,
+    symbols: SymbolTable,
+    fn init(allocator: std.mem.Allocator) !Tokenizer {
+        return Tokenizer{
+            .index = 0,
+            .tokens = Tokens{},
+            .allocator = allocator,
+            .source = "",
+            .symbols = try SymbolTable.init(allocator),
+        };
+    }
+    fn addToken(self: *Tokenizer, comptime t: TokenTag, start: usize, end: usize, symbol: u32) !void {
         try self.tokens.append(self.allocator, Token{
-            .index = self.index,
+            .index = @intCast(start),
+            .len = @intCast(end - start),
             .tag = t,
+            .symbol = symbol,
         });
     }
-    fn feedChar(self: *Tokenizer, c: u8) !void {
-        top: while (true) {
-            switch (self.state) {
-                .normal => switch (c) {
-                    '\"' => {
-                        self.state = .string;
-                        try self.addToken(.string);
-                    },
-                    '(' => try self.addToken(.l_par),
-                    ')' => try self.addToken(.r_par),
-                    'a'...'z', 'A'...'Z', '0'...'9', '+', '-', '=', '<' => {
-                        self.state = .symbol;
-                        try self.addToken(.symbol);
-                    },
-                    ' ', '\n', '\t', '\r' => {},
-                    ';' => self.state = .comment,
-                    else => return TokenizerError.unexpected_char,
-                },
-                .symbol => if (!isSymbolToken(c)) {
-                    self.state = .normal;
-                    continue :top;
-                },
-                .string => switch (c) {
-                    '\\' => self.state = .escape_string,
-                    '\"' => self.state = .normal,
-                    else => {},
-                },
-                .escape_string => self.state = .string,
-                .comment => switch (c) {
-                    '\r', '\n' => self.state = .normal,
-                    else => {},
-                },
-            }
-            break;
-        }
-        self.index += 1;
-        return;
+    /// Tokenizes all of `source`, it has to outlive the tokens and symbols.
+    fn tokenize(self: *Tokenizer, source: []const u8) !void {
+        self.source = source;
+        self.index = 0;
+        // Most tokens are a few bytes long, this saves growing the list
+        // over and over for large inputs.
+        try self.tokens.ensureTotalCapacity(self.allocator, source.len / 3);
+        try self.scan(false);
     }
-    fn feed(self: *Tokenizer, buf: []u8) !void {
-        try self.source.appendSlice(buf);
-        for (buf) |c| {
-            try self.feedChar(c);
+    /// Replaces the tokens with those of the next top-level form of the
+    /// source, allocated with `allocator`. Returns false at the end of the
+    /// source.
+    fn nextForm(self: *Tokenizer, allocator: std.mem.Allocator) !bool {
+        self.allocator = allocator;
+        self.tokens = Tokens{};
+        // As in tokenize, but a small form should not reserve room for the
+        // rest of the source.
+        try self.tokens.ensureTotalCapacity(allocator, @min((self.source.len - self.index) / 3, 1 << 16));
+        try self.scan(true);
+        return self.tokens.len > 0;
+    }
+    fn scan(self: *Tokenizer, one_form: bool) !void {
+        var source = self.source;
+        var i: usize = self.index;
+        var depth: usize = 0;
+        while (i < source.len) {
+            if (one_form and depth == 0 and self.tokens.len > 0) {
+                break;
+            }
+            switch (source[i]) {
+                '(' => {
+                    try self.addToken(.l_par, i, i + 1, 0);
+                    i += 1;
+                    depth += 1;
+                },
+                ')' => {
+                    try self.addToken(.r_par, i, i + 1, 0);
+                    i += 1;
+                    depth -|= 1;
+                },
+                'a'...'z', 'A'...'Z', '0'...'9', '+', '-', '=', '<' => {
+                    var end = symbolEnd(source, i + 1);
+                    try self.addToken(.symbol, i, end, try self.symbols.intern(source[i..end]));
+                    i = end;
+                },
+                '\"' => {
+                    var end = i + 1;
+                    while (end < source.len and source[end] != '\"') {
+                        end += @as(usize, if (source[end] == '\\') 2 else 1);
+                    }
+                    if (end >= source.len) {
+                        self.index = @intCast(i);
+                        return TokenizerError.unterminated_string;
+                    }
+                    end += 1;
+                    try self.addToken(.string, i, end, try self.symbols.intern(source[i..end]));
+                    i = end;
+                },
+                ' ', '\n', '\t', '\r' => i += 1,
+                ';' => i = commentEnd(source, i + 1),
+                else => {
+                    self.index = @intCast(i);
+                    return TokenizerError.unexpected_char;
+                },
+            }
         }
+        self.index = @intCast(i);
     }
 };
 
-fn tokenToSymbol(source: []u8, start: usize) []u8 {
-    var end: usize = start;
-    while (isSymbolToken(source[end])) {
-        end += 1;
-    }
-    return source[start..end];
-}
-
-const ASTTag = enum {
+const ASTTag = enum(u8) {
     list,
     symbol,
     string,
 };
 
-const ASTList = struct {
-    elem: u32,
-    next: u32,
+/// The children of a list are next to each other in Parser.nodes.
+const ASTList = extern struct {
+    first_child: u32,
+    count: u32,
 };
 
-const ASTString = struct {
+const ASTString = extern struct {
     source_start: u32,
+    symbol: u32,
 };
 
-const ASTSymbol = struct {
+const ASTSymbol = extern struct {
     source_start: u32,
+    symbol: u32,
 };
 
-const ASTNode = union(ASTTag) {
+const ASTData = extern union {
     list: ASTList,
     symbol: ASTSymbol,
     string: ASTString,
 };
 
-const AST_EMPTY_LIST = std.math.maxInt(u32);
+const ASTNode = struct {
+    tag: ASTTag,
+    data: ASTData,
+};
+const ASTNodes = std.MultiArrayList(ASTNode);
 
 const Parser = struct {
-    nodes: std.ArrayList(ASTNode),
+    allocator: std.mem.Allocator,
+    nodes: ASTNodes,
+    /// Children of the lists that are being parsed. A list appends them to
+    /// `nodes` once it is complete, which keeps them next to each other.
+    scratch: std.ArrayList(ASTNode),
     index: u32,
-    fn parseList(self: *Parser, tokens: *Tokens.Slice) std.mem.Allocator.Error!u32 {
-        var cursor: u32 = AST_EMPTY_LIST;
-        var id: u32 = AST_EMPTY_LIST;
+
+    fn init(allocator: std.mem.Allocator) Parser {
+        return Parser{
+            .allocator = allocator,
+            .nodes = ASTNodes{},
+            .scratch = std.ArrayList(ASTNode).init(allocator),
+            .index = 0,
+        };
+    }
+
+    fn parseList(self: *Parser, tokens: *Tokens.Slice) std.mem.Allocator.Error!ASTNode {
+        var scratch_start = self.scratch.items.len;
         while (true) {
-            var token = tokens.get(self.index);
-            if (token.tag == .r_par) {
+            if (self.index >= tokens.len) {
+                @panic("unexpected end of input");
+            }
+            if (tokens.items(.tag)[self.index] == .r_par) {
                 self.index += 1;
                 break;
             }
-            var new_cursor: u32 = @truncate(self.nodes.items.len);
-            try self.nodes.append(ASTNode{ .list = ASTList{ .next = AST_EMPTY_LIST, .elem = AST_EMPTY_LIST } });
-            if (id == AST_EMPTY_LIST) {
-                id = new_cursor;
-            } else {
-                self.nodes.items[cursor].list.next = new_cursor;
-            }
-            cursor = new_cursor;
-            //std.debug.print("{d} {d}\n", .{ new_cursor, self.nodes.items.len });
-            var result = try self.parseExpr(tokens);
-            self.nodes.items[new_cursor].list.elem = result;
+            var child = try self.parseNode(tokens);
+            try self.scratch.append(child);
+        }
+        var children = self.scratch.items[scratch_start..];
+        var first_child: u32 = @intCast(self.nodes.len);
+        try self.nodes.ensureUnusedCapacity(self.allocator, children.len);
+        for (children) |child| {
+            self.nodes.appendAssumeCapacity(child);
         }
-        return id;
+        var count: u32 = @intCast(children.len);
+        self.scratch.shrinkRetainingCapacity(scratch_start);
+        return ASTNode{ .tag = .list, .data = .{ .list = .{ .first_child = first_child, .count = count } } };
     }
-    fn parseExpr(self: *Parser, tokens: *Tokens.Slice) std.mem.Allocator.Error!u32 {
+
+    fn parseNode(self: *Parser, tokens: *Tokens.Slice) std.mem.Allocator.Error!ASTNode {
+        if (self.index >= tokens.len) {
+            @panic("unexpected end of input");
+        }
         var token = tokens.get(self.index);
-        var id: u32 = @truncate(self.nodes.items.len);
+        self.index += 1;
         switch (token.tag) {
-            .l_par => {
-                self.index += 1;
-                return try self.parseList(tokens);
-            },
-            .none, .r_par => {
-                @panic("unexpected end of list");
-            },
-            .string => {
-                try self.nodes.append(ASTNode{ .string = ASTString{ .source_start = token.index } });
-                self.index += 1;
-                return id;
-            },
-            .symbol => {
-                try self.nodes.append(ASTNode{ .symbol = ASTSymbol{ .source_start = token.index } });
-                self.index += 1;
-                return id;
-            },
+            .l_par => return try self.parseList(tokens),
+            .none, .r_par => @panic("unexpected end of list"),
+            .string => return ASTNode{ .tag = .string, .data = .{ .string = .{ .source_start = token.index, .symbol = token.symbol } } },
+            .symbol => return ASTNode{ .tag = .symbol, .data = .{ .symbol = .{ .source_start = token.index, .symbol = token.symbol } } },
         }
     }
 
-    fn prettyPrint(self: *Parser, at: u32, in_list: bool) void {
-        if (at == AST_EMPTY_LIST) {
-            return;
-        }
-        switch (self.nodes.items[at]) {
-            .list => |v| {
-                if (!in_list) {
-                    std.debug.print("[", .{});
-                }
-                self.prettyPrint(v.elem, false);
-                self.prettyPrint(v.next, true);
-                if (!in_list) {
-                    std.debug.print("]", .{});
+    /// Parses one expression and returns the index of its node.
+    fn parseExpr(self: *Parser, tokens: *Tokens.Slice) std.mem.Allocator.Error!u32 {
+        var node = try self.parseNode(tokens);
+        try self.nodes.append(self.allocator, node);
+        return @intCast(self.nodes.len - 1);
+    }
+
+    fn prettyPrint(self: *Parser, at: u32, writer: OutputWriter) OutputWriter.Error!void {
+        var data = self.nodes.items(.data)[at];
+        switch (self.nodes.items(.tag)[at]) {
+            .list => {
+                try writer.writeAll("[");
+                for (0..data.list.count) |i| {
+                    try self.prettyPrint(data.list.first_child + @as(u32, @intCast(i)), writer);
                 }
+                try writer.writeAll("]");
             },
-            .symbol => |v| {
-                std.debug.print(" {d} ", .{v.source_start});
-            },
-            .string => |v| {
-                std.debug.print(" {d} ", .{v.source_start});
-            },
+            .symbol => try writer.print(" {d} ", .{data.symbol.source_start}),
+            .string => try writer.print(" {d} ", .{data.string.source_start}),
         }
     }
 };
@@ -212,49 +402,63 @@ const RPNTag = enum {
     condition_end,
     bind,
     bind_captured,
+    bind_boxed,
     set,
-    set_captured,
-    set_by_hops,
-    set_captured_by_hops,
+    set_by_bind,
     get,
-    get_captured,
-    get_by_hops,
-    get_captured_by_hops,
+    get_by_bind,
     push_number,
     call,
+    call_known,
     str,
 };
 
+const RPNLambda = struct {
+    arity: u32,
+    /// The index of the matching lambda_ret.
+    end: u32,
+};
+
 const RPN = union(RPNTag) {
+    /// Left behind by passes that remove instructions, it does nothing.
     placeholder: usize,
-    lambda: usize,
+    lambda: RPNLambda,
     lambda_context_load: usize,
+    /// The index of the matching lambda.
     lambda_ret: usize,
     scope_begin: usize,
     scope_end: usize,
     condition_start: usize,
     condition_else: usize,
     condition_end: usize,
-    bind: []u8,
-    bind_captured: []u8,
-    set: []u8,
-    set_captured: []u8,
-    set_by_hops: usize,
-    set_captured_by_hops: usize,
-    get: []u8,
-    get_captured: []u8,
-    get_by_hops: usize,
-    get_captured_by_hops: usize,
+    // Binds, sets and gets carry the symbol id, see SymbolTable.
+    bind: u32,
+    bind_captured: u32,
+    /// A captured binding that is set after a closure captured it, closures
+    /// share it through a box rather than holding a copy of the value.
+    bind_boxed: u32,
+    set: u32,
+    /// Refers to the index of the bind instruction, see Resolver.
+    set_by_bind: usize,
+    /// Builtins are the only gets that remain unresolved.
+    get: u32,
+    /// Refers to the index of the bind instruction, see Resolver.
+    get_by_bind: usize,
     push_number: i64,
     call: usize,
-    str: usize,
+    /// A call of the lambda at this index, see resolveKnownCallees.
+    call_known: usize,
+    /// The symbol id of the literal, quotes included.
+    str: u32,
 
     pub fn format(value: ?RPN, comptime fmt: []const u8, options: std.fmt.FormatOptions, writer: anytype) !void {
         _ = options;
         _ = fmt;
         switch (value.?) {
-            .set, .get, .get_captured, .bind, .bind_captured => |sym| try writer.print("{s}({s})", .{@tagName(value.?), sym}),
-            .scope_begin, .scope_end, .call, .get_by_hops, .get_captured_by_hops => |num| try writer.print("{s}({d})", .{@tagName(value.?), num}),
+            .set, .get, .bind, .bind_captured, .bind_boxed => |symbol| try writer.print("{s}(#{d})", .{@tagName(value.?), symbol}),
+            .str => |symbol| try writer.print("{s}(#{d})", .{@tagName(value.?), symbol}),
+            .scope_begin, .scope_end, .call, .call_known, .get_by_bind, .set_by_bind, .lambda_ret => |num| try writer.print("{s}({d})", .{@tagName(value.?), num}),
+            .lambda => |lambda| try writer.print("lambda({d}, end {d})", .{lambda.arity, lambda.end}),
             .push_number => |num| try writer.print("{s}({d})", .{@tagName(value.?), num}),
             else => try writer.print("{s}", .{@tagName(value.?)}),
         }
@@ -262,287 +466,416 @@ const RPN = union(RPNTag) {
 };
 
 const RPNConverter = struct {
-    source: []u8,
+    symbols: *const SymbolTable,
     parser: *Parser,
     rpn: std.ArrayList(RPN),
+    /// The source offset of each instruction in `rpn`.
+    sources: std.ArrayList(u32),
+    /// The source offset of what is being converted.
+    source: u32,
+
+    fn append(self: *RPNConverter, instruction: RPN) !void {
+        try self.rpn.append(instruction);
+        try self.sources.append(self.source);
+    }
 
     fn assertSymbol(self: *RPNConverter, at: u32) ASTSymbol {
-        switch (self.parser.nodes.items[at]) {
-            .symbol => |s| return s,
+        switch (self.parser.nodes.items(.tag)[at]) {
+            .symbol => return self.parser.nodes.items(.data)[at].symbol,
             else => @panic("expected symbol but got something else"),
         }
     }
 
     fn assertList(self: *RPNConverter, at: u32) ASTList {
-        switch (self.parser.nodes.items[at]) {
-            .list => |l| return l,
+        switch (self.parser.nodes.items(.tag)[at]) {
+            .list => return self.parser.nodes.items(.data)[at].list,
             else => @panic("expected list but got something else"),
         }
     }
 
-    fn listLength(self: *RPNConverter, at: u32) usize {
-        var list = self.assertList(at);
-        var length: usize = 0;
-        while (true) {
-            length += 1;
-            if (list.next == AST_EMPTY_LIST) {
-                break;
-            }
-            list = self.assertList(list.next);
+    fn assertCount(list: ASTList, count: u32, comptime form: []const u8) void {
+        if (list.count != count) {
+            @panic("malformed " ++ form);
         }
-        return length;
     }
 
-    fn lambdaToRPN(self: *RPNConverter, n: u32) std.mem.Allocator.Error!void {
-        var list = self.assertList(n);
-        var arg_list = self.assertList(list.elem);
-        var expr_list = self.assertList(list.next);
-        var expr = expr_list.elem;
+    /// (lambda (args...) body)
+    fn lambdaToRPN(self: *RPNConverter, list: ASTList) std.mem.Allocator.Error!void {
+        assertCount(list, 3, "lambda");
+        var arg_list = self.assertList(list.first_child + 1);
 
         var lambda_index = self.rpn.items.len;
-        try self.rpn.append(RPN{.lambda = undefined});
-        try self.rpn.append(RPN{.scope_begin = lambda_index + 1});
-        try self.rpn.append(RPN{.lambda_context_load = undefined});
+        try self.append(RPN{.lambda = .{ .arity = arg_list.count, .end = undefined }});
+        try self.append(RPN{.scope_begin = lambda_index + 1});
+        try self.append(RPN{.lambda_context_load = undefined});
 
-        var arg_count: u32 = 0;
-        while (true) {
-            arg_count += 1;
-            var symbol = self.assertSymbol(arg_list.elem);
-            try self.rpn.append(RPN{.bind = tokenToSymbol(self.source, symbol.source_start)});
-            if (arg_list.next == AST_EMPTY_LIST) {
-                break;
-            }
-            arg_list = self.assertList(arg_list.next);
+        for (arg_list.first_child..arg_list.first_child + arg_list.count) |arg| {
+            var symbol = self.assertSymbol(@intCast(arg));
+            try self.append(RPN{.bind = symbol.symbol});
         }
-        self.rpn.items[lambda_index] = RPN{.lambda = arg_count};
 
-        try self.exprToRPN(expr);
+        try self.exprToRPN(list.first_child + 2);
 
-        try self.rpn.append(RPN{.scope_end = lambda_index + 1});
-        try self.rpn.append(RPN{.lambda_ret = undefined});
+        try self.append(RPN{.scope_end = lambda_index + 1});
+        self.rpn.items[lambda_index].lambda.end = @intCast(self.rpn.items.len);
+        try self.append(RPN{.lambda_ret = lambda_index});
     }
 
     fn scopedExprToRPN(self: *RPNConverter, n: u32) std.mem.Allocator.Error!void {
         var scope_id = self.rpn.items.len;
-        try self.rpn.append(RPN{.scope_begin = scope_id});
+        try self.append(RPN{.scope_begin = scope_id});
         try self.exprToRPN(n);
-        try self.rpn.append(RPN{.scope_end = scope_id});
+        try self.append(RPN{.scope_end = scope_id});
     }
 
-    fn ifToRPN(self: *RPNConverter, n: u32) std.mem.Allocator.Error!void {
-        var list = self.assertList(n);
+    /// (if condition positive negative)
+    fn ifToRPN(self: *RPNConverter, list: ASTList) std.mem.Allocator.Error!void {
+        assertCount(list, 4, "if");
+        try self.scopedExprToRPN(list.first_child + 1);
 
-        try self.scopedExprToRPN(list.elem);
-
-        var positive_branch = self.assertList(list.next);
         var condition_start_index = self.rpn.items.len;
-        try self.rpn.append(RPN{.condition_start = undefined});
-        try self.scopedExprToRPN(positive_branch.elem);
+        try self.append(RPN{.condition_start = undefined});
+        try self.scopedExprToRPN(list.first_child + 2);
 
-        var negative_branch = self.assertList(positive_branch.next);
         var condition_else_index = self.rpn.items.len;
-        try self.rpn.append(RPN{.condition_else = undefined});
-        try self.scopedExprToRPN(negative_branch.elem);
+        try self.append(RPN{.condition_else = undefined});
+        try self.scopedExprToRPN(list.first_child + 3);
 
         var condition_end_index = self.rpn.items.len;
-        try self.rpn.append(RPN{.condition_end = undefined});
+        try self.append(RPN{.condition_end = undefined});
 
         // Link the conditions.
         self.rpn.items[condition_start_index] = RPN{.condition_start = condition_else_index};
         self.rpn.items[condition_else_index] = RPN{.condition_else = condition_end_index};
     }
 
-    fn listToRPN(self: *RPNConverter, at: u32) std.mem.Allocator.Error!void {
-        var list = self.assertList(at);
-        while (true) {
-            try self.exprToRPN(list.elem);
-            if (list.next == AST_EMPTY_LIST) {
-                break;
-            }
-            list = self.assertList(list.next);
+    /// (let (name value...) body)
+    fn letToRPN(self: *RPNConverter, list: ASTList) std.mem.Allocator.Error!void {
+        assertCount(list, 3, "let");
+        var statements = self.assertList(list.first_child + 1);
+        if (statements.count % 2 != 0) {
+            @panic("malformed let bindings");
         }
-    }
-
-    fn letToRPN(self: *RPNConverter, at: u32) std.mem.Allocator.Error!void {
-        var list = self.assertList(at);
-        var statements = self.assertList(list.elem);
 
         var scope_id = self.rpn.items.len;
-        try self.rpn.append(RPN{.scope_begin = scope_id});
-        while (true) {
-            var symbol = self.assertSymbol(statements.elem);
-            statements = self.assertList(statements.next);
-            var expr = statements.elem;
-
-            try self.rpn.append(RPN{.push_number = 0});
-            try self.rpn.append(RPN{.bind = tokenToSymbol(self.source, symbol.source_start)});
+        try self.append(RPN{.scope_begin = scope_id});
+        var i = statements.first_child;
+        while (i < statements.first_child + statements.count) : (i += 2) {
+            var symbol = self.assertSymbol(i);
 
-            try self.exprToRPN(expr);
+            try self.append(RPN{.push_number = 0});
+            try self.append(RPN{.bind = symbol.symbol});
 
-            try self.rpn.append(RPN{.set = tokenToSymbol(self.source, symbol.source_start)});
+            try self.exprToRPN(i + 1);
 
-            if (statements.next == AST_EMPTY_LIST) {
-                break;
-            }
-            list = self.assertList(list.next);
+            try self.append(RPN{.set = symbol.symbol});
         }
 
-        var expression = self.assertList(list.next);
-        try self.exprToRPN(expression.elem);
+        try self.exprToRPN(list.first_child + 2);
 
-        try self.rpn.append(RPN{.scope_end = scope_id});
+        try self.append(RPN{.scope_end = scope_id});
     }
 
     fn exprToRPN(self: *RPNConverter, at: u32) std.mem.Allocator.Error!void {
-        if (at == AST_EMPTY_LIST) {
-            return;
-        }
-        switch (self.parser.nodes.items[at]) {
-            .list => |v| {
-                if (v.next == AST_EMPTY_LIST) {
+        var data = self.parser.nodes.items(.data)[at];
+        switch (self.parser.nodes.items(.tag)[at]) {
+            .list => {
+                var list = data.list;
+                if (list.count == 0) {
+                    return;
+                }
+                if (list.count == 1) {
                     @panic("empty call detected");
                 }
-                switch (self.parser.nodes.items[v.elem]) {
-                    .symbol => |s| {
-                        const symbol = tokenToSymbol(self.source, s.source_start);
-                        if (std.mem.eql(u8, symbol, "lambda")) {
-                            try self.lambdaToRPN(v.next);
-                            return;
-                        }
-                        if (std.mem.eql(u8, symbol, "if")) {
-                            try self.ifToRPN(v.next);
-                            return;
-                        }
-                        if (std.mem.eql(u8, symbol, "let")) {
-                            try self.letToRPN(v.next);
-                            return;
-                        }
-                    },
-                    else => {},
-                }
-                try self.listToRPN(v.next);
-                try self.exprToRPN(v.elem);
-                var call_arity = self.listLength(v.next);
-                try self.rpn.append(RPN{.call = call_arity});
-            },
-            .symbol => |v| {
-                const symbol = tokenToSymbol(self.source, v.source_start);
-                if (std.fmt.parseInt(i64, symbol, 10)) |num| {
-                    try self.rpn.append(RPN{.push_number = num});
+                var head = list.first_child;
+                var source = self.source;
+                if (self.parser.nodes.items(.tag)[head] == .symbol) {
+                    source = self.parser.nodes.items(.data)[head].symbol.source_start;
+                    self.source = source;
+                    switch (self.parser.nodes.items(.data)[head].symbol.symbol) {
+                        symbol_lambda => return self.lambdaToRPN(list),
+                        symbol_if => return self.ifToRPN(list),
+                        symbol_let => return self.letToRPN(list),
+                        else => {},
+                    }
+                }
+                for (head + 1..head + list.count) |arg| {
+                    try self.exprToRPN(@intCast(arg));
+                }
+                try self.exprToRPN(head);
+                self.source = source;
+                try self.append(RPN{.call = list.count - 1});
+            },
+            .symbol => {
+                self.source = data.symbol.source_start;
+                if (std.fmt.parseInt(i64, self.symbols.nameOf(data.symbol.symbol), 10)) |num| {
+                    try self.append(RPN{.push_number = num});
                 } else |_| {
-                    try self.rpn.append(RPN{.get = tokenToSymbol(self.source, v.source_start)});
+                    try self.append(RPN{.get = data.symbol.symbol});
                 }
             },
-            .string => |v| {
-                try self.rpn.append(RPN{.str = v.source_start});
+            .string => {
+                self.source = data.string.source_start;
+                try self.append(RPN{.str = data.string.symbol});
             },
         }
     }
 };
 
-fn rpnDetectCaptured(rpn: []RPN) void {
-    // TODO: Detect if in same lambda but different scope.
-    for(0..rpn.len) |i| {
-        switch (rpn[i]) {
-            .set, .get => |search| {
-                var depth: i32 = 0;
-                var j = i;
-                var lambda_passed = false;
-                while(true) {
-                    switch (rpn[j]) {
-                        .bind => |found| {
-                            if (depth < 0
-                                and std.mem.eql(u8, search, found)
-                                and lambda_passed) {
-                                rpn[j] = RPN{.bind_captured = found};
-                                break;
-                            }
-                        },
-                        .lambda_context_load => {
-                            if (depth <= 0) {
-                                lambda_passed = true;
-                            }
-                        },
-                        .scope_begin => depth -= 1,
-                        .scope_end => depth += 1,
-                        else => {}
+const Binding = struct {
+    /// Index of the bind instruction.
+    bind: usize,
+    symbol: u32,
+    /// The binding of the same symbol that this one shadows.
+    shadowed: u32,
+    lambda_depth: u32,
+    captured: bool,
+};
+
+const NO_BINDING = std.math.maxInt(u32);
+
+/// Resolves every get and set to the bind instruction it refers to in a
+/// single forward pass. Bindings referred to from a nested lambda become
+/// bind_captured, and captured bindings that are set afterwards become
+/// bind_boxed, since closures copy the values they capture.
+const Resolver = struct {
+    symbols: *const SymbolTable,
+    /// Index into `bindings` of the innermost binding of each symbol.
+    innermost: std.ArrayList(u32),
+    bindings: std.ArrayList(Binding),
+    /// Length of `bindings` at the start of each open scope.
+    scopes: std.ArrayList(usize),
+
+    fn init(allocator: std.mem.Allocator, symbols: *const SymbolTable) !Resolver {
+        var innermost = std.ArrayList(u32).init(allocator);
+        try innermost.appendNTimes(NO_BINDING, symbols.count());
+        return Resolver{
+            .symbols = symbols,
+            .innermost = innermost,
+            .bindings = std.ArrayList(Binding).init(allocator),
+            .scopes = std.ArrayList(usize).init(allocator),
+        };
+    }
+
+    fn lookup(self: *Resolver, symbol: u32) ?*Binding {
+        var binding = self.innermost.items[symbol];
+        if (binding == NO_BINDING) {
+            return null;
+        }
+        return &self.bindings.items[binding];
+    }
+
+    fn resolve(self: *Resolver, rpn: []RPN) !void {
+        var lambda_depth: u32 = 0;
+        for (rpn, 0..) |instruction, i| {
+            switch (instruction) {
+                .lambda => lambda_depth += 1,
+                .lambda_ret => lambda_depth -= 1,
+                .scope_begin => try self.scopes.append(self.bindings.items.len),
+                .scope_end => {
+                    var bindings_len = self.scopes.pop();
+                    while (self.bindings.items.len > bindings_len) {
+                        var binding = self.bindings.pop();
+                        self.innermost.items[binding.symbol] = binding.shadowed;
+                    }
+                },
+                .bind => |symbol| {
+                    try self.bindings.append(Binding{
+                        .bind = i,
+                        .symbol = symbol,
+                        .shadowed = self.innermost.items[symbol],
+                        .lambda_depth = lambda_depth,
+                        .captured = false,
+                    });
+                    self.innermost.items[symbol] = @intCast(self.bindings.items.len - 1);
+                },
+                .get => |symbol| if (self.lookup(symbol)) |binding| {
+                    if (binding.lambda_depth < lambda_depth) {
+                        binding.captured = true;
+                        if (rpn[binding.bind] == .bind) {
+                            rpn[binding.bind] = RPN{.bind_captured = symbol};
+                        }
                     }
-                    if (j == 0) {
-                        break;
+                    rpn[i] = RPN{.get_by_bind = binding.bind};
+                },
+                .set => |symbol| {
+                    var binding = self.lookup(symbol) orelse std.debug.panic("set of unbound symbol: {s}", .{self.symbols.nameOf(symbol)});
+                    if (binding.captured) {
+                        rpn[binding.bind] = RPN{.bind_boxed = symbol};
                     }
-                    j -= 1;
+                    rpn[i] = RPN{.set_by_bind = binding.bind};
+                },
+                else => {},
+            }
+        }
+    }
+};
+
+fn rpnFindLambdas(rpn: []RPN, list: *std.ArrayList(usize)) !void {
+    for(0..rpn.len) |i| {
+        switch (rpn[i]) {
+            .lambda => try list.append(i),
+            else => {}
+        }
+    }
+}
+
+/// Returns the index of the instruction after `i`, skipping placeholders.
+fn rpnNext(rpn: []RPN, i: usize) usize {
+    var j = i + 1;
+    while (rpn[j] == .placeholder) {
+        j += 1;
+    }
+    return j;
+}
+
+/// Returns the index of the instruction before `i`, skipping placeholders.
+fn rpnPrevious(rpn: []RPN, i: usize) usize {
+    var j = i - 1;
+    while (rpn[j] == .placeholder) {
+        j -= 1;
+    }
+    return j;
+}
+
+fn rpnRemove(rpn: []RPN, start: usize, end: usize) void {
+    for (rpn[start..end]) |*instruction| {
+        instruction.* = RPN{.placeholder = 0};
+    }
+}
+
+/// Turns lambdas that are called right where they are made, like
+/// ((lambda (y) ...) 332), into a scope that binds the arguments, so they
+/// need neither a closure nor a call. Runs before the Resolver, which then
+/// sees the bindings they refer to as their own instead of captured ones.
+fn inlineAppliedLambdas(rpn: []RPN) void {
+    for (0..rpn.len) |i| {
+        var applied = switch (rpn[i]) {
+            .lambda => |info| info,
+            else => continue,
+        };
+        var call = applied.end + 1;
+        if (call >= rpn.len or rpn[call] != .call or rpn[call].call != applied.arity) {
+            continue;
+        }
+        // The lambda, its scope_begin and lambda_context_load come before
+        // the parameters, see lambdaToRPN.
+        var params = rpn[i + 3 .. i + 3 + applied.arity];
+        var distinct = true;
+        for (params, 0..) |param, k| {
+            for (params[0..k]) |other| {
+                distinct = distinct and param.bind != other.bind;
+            }
+        }
+        if (!distinct) {
+            continue;
+        }
+        // Binds take the top of the stack, which is the last argument.
+        std.mem.reverse(RPN, params);
+        rpnRemove(rpn, i, i + 1);
+        rpnRemove(rpn, i + 2, i + 3);
+        rpnRemove(rpn, applied.end, call + 1);
+    }
+}
+
+/// Folds calls to pure builtins on constants and removes the branches of
+/// conditions on constants that can never run. Runs after the Resolver, so
+/// every get that is left refers to a builtin.
+fn foldConstants(rpn: []RPN) void {
+    for (0..rpn.len) |i| {
+        switch (rpn[i]) {
+            .call => |arity| {
+                if (arity != 2) {
+                    continue;
+                }
+                var callee = rpnPrevious(rpn, i);
+                var fold = switch (rpn[callee]) {
+                    .get => |symbol| (builtinOf(symbol) orelse continue).fold orelse continue,
+                    else => continue,
+                };
+                var rhs = rpnPrevious(rpn, callee);
+                var lhs = rpnPrevious(rpn, rhs);
+                if (rpn[lhs] != .push_number or rpn[rhs] != .push_number) {
+                    continue;
                 }
+                var result = fold(rpn[lhs].push_number, rpn[rhs].push_number);
+                rpnRemove(rpn, lhs, i);
+                rpn[i] = RPN{.push_number = result};
+            },
+            .condition_start => |condition_else| {
+                // Conditions are scoped, see ifToRPN.
+                var scope_end = rpnPrevious(rpn, i);
+                var value = rpnPrevious(rpn, scope_end);
+                if (rpn[value] != .push_number or rpn[rpnPrevious(rpn, value)] != .scope_begin) {
+                    continue;
+                }
+                var condition_end = rpn[condition_else].condition_else;
+                if (rpn[value].push_number != 0) {
+                    rpnRemove(rpn, condition_else, condition_end + 1);
+                    rpnRemove(rpn, i, i + 1);
+                } else {
+                    rpnRemove(rpn, i, condition_else + 1);
+                    rpnRemove(rpn, condition_end, condition_end + 1);
+                }
+                rpnRemove(rpn, value, value + 1);
             },
             else => {},
         }
     }
 }
 
-fn rpnFixGetCaptures(rpn: []RPN) void {
-    for(0..rpn.len) |i| {
-        switch (rpn[i]) {
-            .get => |search| {
-                var depth: i32 = 0;
-                var j = i;
-                while(true) {
-                    switch (rpn[j]) {
-                        .bind_captured => |found| {
-                            if (depth <= 0
-                                and std.mem.eql(u8, found, search)) {
-                                rpn[i] = RPN{.get_captured = search};
-                                break;
-                            }
-                        },
-                        .bind => |found| {
-                            if (depth <= 0
-                                and std.mem.eql(u8, found, search)) {
-                                break;
-                            }
-                        },
-                        .scope_begin => depth -= 1,
-                        .scope_end => depth += 1,
-                        else => {}
-                    }
-                    if (j == 0) {
-                        break;
-                    }
-                    j -= 1;
+/// Maps the bind of every let bound lambda that is never set again to the
+/// lambda, so every get of the binding is known to be that lambda.
+fn knownLambdas(allocator: std.mem.Allocator, rpn: []RPN) !std.AutoHashMap(usize, usize) {
+    // The lambda bound by each bind, for bindings whose only set is the
+    // one of their let.
+    var known = std.AutoHashMap(usize, usize).init(allocator);
+    for (rpn, 0..) |instruction, i| {
+        switch (instruction) {
+            .bind, .bind_captured, .bind_boxed => {
+                var value = rpnNext(rpn, i);
+                if (rpn[value] != .lambda) {
+                    continue;
+                }
+                var set = rpnNext(rpn, rpn[value].lambda.end);
+                if (rpn[set] == .set_by_bind and rpn[set].set_by_bind == i) {
+                    try known.put(i, value);
+                }
+            },
+            else => {},
+        }
+    }
+    for (rpn, 0..) |instruction, i| {
+        switch (instruction) {
+            .set_by_bind => |bind| if (known.get(bind)) |value| {
+                if (i != rpnNext(rpn, rpn[value].lambda.end)) {
+                    _ = known.remove(bind);
                 }
             },
             else => {},
         }
     }
+    return known;
 }
 
-fn rpnFixSetCaptures(rpn: []RPN) void {
-    for(0..rpn.len) |i| {
-        switch (rpn[i]) {
-            .set => |search| {
-                var depth: i32 = 0;
-                var j = i;
-                while(true) {
-                    switch (rpn[j]) {
-                        .bind_captured => |found| {
-                            if (depth <= 0
-                                and std.mem.eql(u8, found, search)) {
-                                rpn[i] = RPN{.set_captured = search};
-                                break;
-                            }
-                        },
-                        .bind => |found| {
-                            if (depth <= 0
-                                and std.mem.eql(u8, found, search)) {
-                                break;
-                            }
-                        },
-                        .scope_begin => depth -= 1,
-                        .scope_end => depth += 1,
-                        else => {}
-                    }
-                    if (j == 0) {
-                        break;
+/// Turns calls of let bound lambdas that are never set again, with as many
+/// arguments as the lambda takes, into call_known, so they call the
+/// function of the lambda directly instead of going through the type of
+/// the callee. Tail calls are left alone, they are made by the caller, see
+/// supTailCall.
+fn resolveKnownCallees(allocator: std.mem.Allocator, rpn: []RPN) !void {
+    var known = try knownLambdas(allocator, rpn);
+    for (rpn, 0..) |instruction, i| {
+        switch (instruction) {
+            .call => {
+                var callee = rpnPrevious(rpn, i);
+                if (rpn[callee] != .get_by_bind or isTailCall(rpn, i)) {
+                    continue;
+                }
+                if (known.get(rpn[callee].get_by_bind)) |value| {
+                    if (rpn[value].lambda.arity == rpn[i].call) {
+                        rpn[i] = RPN{.call_known = value};
                     }
-                    j -= 1;
                 }
             },
             else => {},
@@ -550,58 +883,184 @@ fn rpnFixSetCaptures(rpn: []RPN) void {
     }
 }
 
+/// The lambdas that compute a number from numbers alone, see
+/// inferIntegerLambdas.
+const IntegerLambdas = struct {
+    /// Whether the lambda at each RPN index is one.
+    integer: []bool,
+    known: std.AutoHashMap(usize, usize),
+
+    /// The lambda called at `call_index`, when it is known.
+    fn callee(self: *const IntegerLambdas, rpn: []RPN, call_index: usize) ?usize {
+        return switch (rpn[call_index]) {
+            .call_known => |value| value,
+            .call => switch (rpn[rpnPrevious(rpn, call_index)]) {
+                .get_by_bind => |bind| self.known.get(bind),
+                else => null,
+            },
+            else => null,
+        };
+    }
 
-fn rpnConvertGetToGetBySteps(rpn: []RPN) void {
-    for(0..rpn.len) |i| {
-        switch (rpn[i]) {
-            .get => |search| {
-                var depth: i32 = 0;
-                var steps: usize = 0;
-                var j = i;
-                while(true) {
-                    switch (rpn[j]) {
-                        .bind => |found| {
-                            if (depth <= 0) {
-                                if (std.mem.eql(u8, search, found)) {
-                                    rpn[i] = RPN{.get_by_hops = steps};
-                                    break;
-                                }
-                                steps += 1;
-                            }
-                        },
-                        .scope_begin => depth -= 1,
-                        .scope_end => depth += 1,
-                        else => {}
+    /// Whether the lambda at `start` takes numbers and returns a number
+    /// when all the lambdas it calls are integer lambdas. Its bindings are
+    /// then numbers too, so only numbers are ever on its stack, and a get
+    /// of anything but a number has to be the callee of a call.
+    fn check(self: *const IntegerLambdas, rpn: []RPN, start: usize) bool {
+        var lambda = rpn[start].lambda;
+        var depth: usize = 0;
+        var param: u32 = 0;
+        var i = start + 1;
+        while (i < lambda.end) : (i += 1) {
+            switch (rpn[i]) {
+                .scope_begin, .scope_end, .placeholder, .lambda_context_load, .condition_end => {},
+                .push_number => depth += 1,
+                .bind => if (param < lambda.arity) {
+                    param += 1;
+                } else if (depth > 0) {
+                    depth -= 1;
+                } else {
+                    return false;
+                },
+                .set_by_bind => |bind| {
+                    if (bind < start or depth == 0) {
+                        return false;
+                    }
+                    depth -= 1;
+                },
+                .get_by_bind => |bind| {
+                    var next = rpn[rpnNext(rpn, i)];
+                    if (bind > start) {
+                        depth += 1;
+                    } else if (next != .call and next != .call_known) {
+                        return false;
                     }
-                    if (j == 0) {
-                        break;
+                },
+                // Builtins other than the operators are left out, str-to-num
+                // too: its argument is a string, which an integer lambda
+                // cannot hold. What it returns reaches integer lambdas
+                // through their entry, which checks for numbers.
+                .get => if (inlineOperatorC(rpn, rpnNext(rpn, i)) == null) {
+                    return false;
+                },
+                .call, .call_known => {
+                    var argc: usize = 2;
+                    if (inlineOperatorC(rpn, i) == null) {
+                        var value = self.callee(rpn, i) orelse return false;
+                        argc = rpn[value].lambda.arity;
+                        if (!self.integer[value] or (rpn[i] == .call and rpn[i].call != argc)) {
+                            return false;
+                        }
                     }
-                    j -= 1;
-                }
-            },
-            .get_captured => |search| {
-                var depth: i32 = 0;
-                var steps: usize = 0;
-                var j = i;
-                while(true) {
-                    switch (rpn[j]) {
-                        .bind_captured => |found| {
-                            if (depth <= 0) {
-                                if (std.mem.eql(u8, search, found)) {
-                                    rpn[i] = RPN{.get_captured_by_hops = steps};
-                                    break;
-                                }
-                                steps += 1;
-                            }
-                        },
-                        .scope_end => depth += 1,
-                        .scope_begin => depth -= 1,
-                        else => {}
+                    if (depth < argc) {
+                        return false;
                     }
-                    if (j == 0) {
-                        break;
+                    depth = depth - argc + 1;
+                },
+                // The value of the positive branch is moved out of the way
+                // of the negative one.
+                .condition_start, .condition_else => {
+                    if (depth == 0) {
+                        return false;
                     }
-                    j -= 1;
+                    depth -= 1;
+                },
+                // Strings, closures, captured and boxed bindings.
+                else => return false,
+            }
+        }
+        return param == lambda.arity and depth == 1;
+    }
+};
+
+/// Finds the integer lambdas, whose arguments, bindings and result are
+/// all numbers, so CodegenC can give them a C function on plain i64. Every
+/// lambda starts out as one and those whose check fails are ruled out
+/// until nothing changes, which keeps recursive lambdas like fib.
+fn inferIntegerLambdas(allocator: std.mem.Allocator, rpn: []RPN) !IntegerLambdas {
+    var lambdas = IntegerLambdas{
+        .integer = try allocator.alloc(bool, rpn.len),
+        .known = try knownLambdas(allocator, rpn),
+    };
+    for (lambdas.integer, rpn) |*integer, instruction| {
+        integer.* = instruction == .lambda;
+    }
+    var changed = true;
+    while (changed) {
+        changed = false;
+        for (rpn, 0..) |instruction, start| {
+            if (instruction == .lambda and lambdas.integer[start] and !lambdas.check(rpn, start)) {
+                lambdas.integer[start] = false;
+                changed = true;
+            }
+        }
+    }
+    return lambdas;
+}
+
+fn builtinName(symbols: *const SymbolTable, symbol: u32) []const u8 {
+    if (builtinOf(symbol)) |b| {
+        return b.c_name;
+    }
+    std.debug.panic("unknown primitive: {s}", .{symbols.nameOf(symbol)});
+}
+
+/// Returns the C operator for a call that can be emitted inline, that is
+/// a call with two arguments to one of the arithmetic builtins.
+fn inlineOperatorC(rpn: []RPN, call_index: usize) ?[]const u8 {
+    switch (rpn[call_index]) {
+        .call => |arity| if (arity != 2) return null,
+        else => return null,
+    }
+    return switch (rpn[rpnPrevious(rpn, call_index)]) {
+        .get => |symbol| (builtinOf(symbol) orelse return null).operator,
+        else => null,
+    };
+}
+
+/// Values that CodegenC has not pushed onto the runtime stack yet. Each
+/// entry is the RPN index where a side effect free value ends, which lets
+/// arithmetic on them be emitted as a single C expression on i64.
+const PendingValues = struct {
+    ends: [32]usize = undefined,
+    len: usize = 0,
+};
+
+fn pureValueStart(rpn: []RPN, end: usize) usize {
+    switch (rpn[end]) {
+        .call => {
+            var rhs_start = pureValueStart(rpn, rpnPrevious(rpn, rpnPrevious(rpn, end)));
+            return pureValueStart(rpn, rpnPrevious(rpn, rhs_start));
+        },
+        else => return end,
+    }
+}
+
+/// Counts the bindings made directly by the lambda at `start`, each of
+/// them gets its own slot in the `locals` array of the C function.
+fn lambdaLocalCount(rpn: []RPN, start: usize) usize {
+    var count: usize = 0;
+    var i = start + 1;
+    while (i < rpn[start].lambda.end) : (i += 1) {
+        switch (rpn[i]) {
+            .lambda => |nested| i = nested.end,
+            .bind, .bind_captured, .bind_boxed => count += 1,
+            else => {},
+        }
+    }
+    return count;
+}
+
+/// Collects the bindings made outside of the lambda at `start` that it,
+/// or a lambda nested in it, refers to. Those are all captured. The order
+/// of `free` is the layout of the environment of the closure.
+fn lambdaFreeVariables(rpn: []RPN, start: usize, free: *std.ArrayList(usize)) !void {
+    free.clearRetainingCapacity();
+    for (rpn[start..rpn[start].lambda.end]) |instruction| {
+        switch (instruction) {
+            .get_by_bind, .set_by_bind => |bind| {
+                if (bind < start and std.mem.indexOfScalar(usize, free.items, bind) == null) {
+                    try free.append(bind);
                 }
             },
             else => {},
@@ -609,291 +1068,2844 @@ fn rpnConvertGetToGetBySteps(rpn: []RPN) void {
     }
 }
 
-fn rpnConvertSetToSetBySteps(rpn: []RPN) void {
-    for(0..rpn.len) |i| {
+/// Whether the closure made by the lambda at `nested`, right inside the
+/// lambda at `start`, never outlives the call of `start` that made it. It
+/// has to be let bound and never set again, and every get of the binding
+/// has to be the callee of a call that is not a tail call. Then it is
+/// never stored, returned, passed on or captured, and the binding is not
+/// captured either, so all the gets are in the body of `start`. Its
+/// environment can then live in the locals of `start`, see
+/// CodegenC.closure.
+fn closureStaysLocal(rpn: []RPN, start: usize, nested: usize) bool {
+    var bind = rpnPrevious(rpn, nested);
+    var set = rpnNext(rpn, rpn[nested].lambda.end);
+    if (rpn[bind] != .bind or rpn[set] != .set_by_bind or rpn[set].set_by_bind != bind) {
+        return false;
+    }
+    for (start + 1..rpn[start].lambda.end) |i| {
         switch (rpn[i]) {
-            .set => |search| {
-                var depth: i32 = 0;
-                var steps: usize = 0;
-                var j = i;
-                while(true) {
-                    switch (rpn[j]) {
-                        .bind => |found| {
-                            if (depth <= 0) {
-                                if (std.mem.eql(u8, search, found)) {
-                                    rpn[i] = RPN{.set_by_hops = steps};
-                                    break;
-                                }
-                                steps += 1;
-                            }
-                        },
-                        .scope_begin => depth -= 1,
-                        .scope_end => depth += 1,
-                        else => {}
-                    }
-                    if (j == 0) {
-                        break;
-                    }
-                    j -= 1;
-                }
-            },
-            .set_captured => |search| {
-                var depth: i32 = 0;
-                var steps: usize = 0;
-                var j = i;
-                while(true) {
-                    switch (rpn[j]) {
-                        .bind_captured => |found| {
-                            if (depth <= 0) {
-                                if (std.mem.eql(u8, search, found)) {
-                                    rpn[i] = RPN{.set_captured_by_hops = steps};
-                                    break;
-                                }
-                                steps += 1;
-                            }
-                        },
-                        .scope_end => depth += 1,
-                        .scope_begin => depth -= 1,
-                        else => {}
-                    }
-                    if (j == 0) {
-                        break;
-                    }
-                    j -= 1;
+            .get_by_bind => |b| if (b == bind) {
+                var call = rpnNext(rpn, i);
+                if (rpn[call] != .call_known and (rpn[call] != .call or isTailCall(rpn, call))) {
+                    return false;
                 }
             },
+            .set_by_bind => |b| if (b == bind and i != set) {
+                return false;
+            },
             else => {},
         }
     }
+    return true;
 }
 
-
-fn rpnFindLambdas(rpn: []RPN, list: *std.ArrayList(usize)) !void {
-    for(0..rpn.len) |i| {
+/// A call is in tail position when nothing but the ends of scopes and
+/// conditions follow it before the lambda returns.
+fn isTailCall(rpn: []RPN, call_index: usize) bool {
+    var i = call_index + 1;
+    while (true) {
         switch (rpn[i]) {
-            .lambda => try list.append(i),
-            else => {}
+            .scope_end, .condition_end, .placeholder => i += 1,
+            // The positive branch continues after the end of the negative one.
+            .condition_else => |end| i = end,
+            .lambda_ret => return true,
+            else => return false,
         }
     }
 }
 
-fn builtinName(sym: []u8) []const u8 {
-    if (std.mem.eql(u8, sym, "+")) {
-        return "sup_builtin_add";
-    }
-    if (std.mem.eql(u8, sym, "-")) {
-        return "sup_builtin_subtract";
+/// Whether the lambda at `start` makes a tail call with as many arguments
+/// as it takes, which jumps back to its entry when the callee is itself.
+/// Other tail calls go through supTailCall and never need the label.
+fn lambdaHasSelfTailCall(rpn: []RPN, start: usize) bool {
+    var i = start + 1;
+    while (i < rpn[start].lambda.end) : (i += 1) {
+        switch (rpn[i]) {
+            .lambda => |nested| i = nested.end,
+            .call => |argc| if (argc == rpn[start].lambda.arity and inlineOperatorC(rpn, i) == null and isTailCall(rpn, i)) {
+                return true;
+            },
+            else => {},
+        }
     }
-    if (std.mem.eql(u8, sym, "=")) {
-        return "sup_builtin_equals";
+    return false;
+}
+
+/// Whether the lambda at `start` gets a _direct function taking its
+/// arguments as C parameters. Boxing a parameter allocates, the collector
+/// can then move the values of the others, so those lambdas only read
+/// their arguments from the stack.
+fn lambdaHasDirect(rpn: []RPN, start: usize) bool {
+    var param: u32 = 0;
+    var i = start + 1;
+    while (param < rpn[start].lambda.arity) : (i += 1) {
+        switch (rpn[i]) {
+            .lambda => |nested| i = nested.end,
+            .bind, .bind_captured => param += 1,
+            .bind_boxed => return false,
+            else => {},
+        }
+    }
+    return true;
+}
+
+/// The parameters of a _direct function, its arguments and then the
+/// callee, which holds the environment of a closure.
+fn writeDirectParams(writer: anytype, arity: usize) !void {
+    for (0..arity) |param| {
+        try writer.print("struct ManagedVariable a{d}, ", .{param});
+    }
+    try writer.writeAll("struct ManagedVariable callee");
+}
+
+/// Writes a string token as a C string literal. Escapes mean the same in
+/// both languages, only the characters a C literal cannot hold as they
+/// are need to be escaped.
+fn writeStringLiteralC(writer: anytype, token: []const u8) !void {
+    try writer.writeByte('"');
+    var i: usize = 1;
+    while (i < token.len - 1) : (i += 1) {
+        var c = token[i];
+        switch (c) {
+            '\\' => {
+                try writer.writeAll(token[i .. i + 2]);
+                i += 1;
+            },
+            '\n' => try writer.writeAll("\\n"),
+            '\r' => try writer.writeAll("\\r"),
+            '\t' => try writer.writeAll("\\t"),
+            // Also keeps "??" from turning into a trigraph.
+            '?' => try writer.writeAll("\\?"),
+            0x20...0x3e, 0x40...0x5b, 0x5d...0x7e => try writer.writeByte(c),
+            else => try writer.print("\\{o:0>3}", .{c}),
+        }
+    }
+    try writer.writeByte('"');
+}
+
+/// Writes the name of the static data of a string token. It is named after
+/// the text rather than the symbol id, so the C of a form does not depend on
+/// the forms before it, see Compiler.cachedForm.
+fn writeStringName(writer: anytype, token: []const u8) !void {
+    try writer.print("lol_string_{x:0>16}", .{std.hash.Wyhash.hash(0, token)});
+}
+
+/// Writes `bytes` as the inside of a C string literal.
+fn writeEscapedC(writer: anytype, bytes: []const u8) !void {
+    for (bytes) |c| {
+        switch (c) {
+            '\\', '"', '?' => try writer.print("\\{c}", .{c}),
+            0x20...0x21, 0x23...0x3e, 0x40...0x5b, 0x5d...0x7e => try writer.writeByte(c),
+            else => try writer.print("\\{o:0>3}", .{c}),
+        }
+    }
+}
+
+/// The name of the binding the lambda at `start` is let bound to, if any.
+/// Parameters are bound right before the body too, a bind only names the
+/// lambda when its let sets it to the lambda, see knownLambdas.
+fn lambdaName(rpn: []RPN, symbols: *const SymbolTable, start: usize) []const u8 {
+    if (start == 0) {
+        return "lambda";
+    }
+    var bind = rpnPrevious(rpn, start);
+    var set = rpnNext(rpn, rpn[start].lambda.end);
+    if (rpn[set] != .set_by_bind or rpn[set].set_by_bind != bind) {
+        return "lambda";
+    }
+    return switch (rpn[bind]) {
+        .bind, .bind_captured, .bind_boxed => |symbol| symbols.nameOf(symbol),
+        else => "lambda",
+    };
+}
+
+/// Writes the name of the C function of the lambda at `start`, lol_fib_12
+/// for a lambda let bound to fib.
+fn writeLambdaFunc(writer: anytype, rpn: []RPN, symbols: *const SymbolTable, lambda_base: usize, start: usize) !void {
+    try writer.writeAll("lol_");
+    for (lambdaName(rpn, symbols, start)) |c| {
+        try writer.writeByte(if (std.ascii.isAlphanumeric(c)) c else '_');
+    }
+    try writer.print("_{d}", .{lambda_base + start});
+}
+
+const CodegenC = struct {
+    rpn: []RPN,
+    symbols: *const SymbolTable,
+    writer: std.ArrayList(u8).Writer,
+    pending: PendingValues,
+    /// Slots in `locals` of the bindings made by this lambda, by the index
+    /// of their bind instruction.
+    slots: std.AutoHashMap(usize, usize),
+    /// Free variables of this lambda, see lambdaFreeVariables.
+    free: std.ArrayList(usize),
+    nested_free: std.ArrayList(usize),
+    /// The lambdas right inside this one whose environment is in its
+    /// locals, see closureStaysLocal.
+    local_closures: std.ArrayList(usize),
+    local_count: usize,
+    /// The lambda that is being generated.
+    start: usize,
+    /// The next parameter of it to bind, see paramBind.
+    param: u32,
+    /// Whether it is generated as its _direct function, see
+    /// lambdaHasDirect.
+    direct: bool,
+    /// Records calls in the lol_profile_ site of every lambda, see
+    /// Compiler.profileSites.
+    profile: bool,
+    /// The source line of each instruction, written as #line directives
+    /// when set.
+    lines: ?[]const u32,
+    path: []const u8,
+    /// The line of the last #line directive.
+    line: u32,
+    has_frame: bool,
+    /// Added to RPN indices to name lambdas, so names stay unique across
+    /// top-level forms.
+    lambda_base: usize,
+    /// Set for code loaded by the interpreter, see Interpreter.compile.
+    /// Lambda types are then the interpreter's, `lol_types` indexed by the
+    /// lambda id at each RPN index.
+    jit_ids: ?[]const u32,
+    /// Integer lambdas get a function on plain i64 when set.
+    integer: ?*const IntegerLambdas,
+    /// The stack of integerLambda, the index of the instruction that made
+    /// each value.
+    values: std.ArrayList(usize),
+    params: std.ArrayList(usize),
+
+    fn init(allocator: std.mem.Allocator, rpn: []RPN, symbols: *const SymbolTable, lambda_base: usize, writer: std.ArrayList(u8).Writer) CodegenC {
+        return CodegenC{
+            .rpn = rpn,
+            .symbols = symbols,
+            .writer = writer,
+            .pending = PendingValues{},
+            .slots = std.AutoHashMap(usize, usize).init(allocator),
+            .free = std.ArrayList(usize).init(allocator),
+            .nested_free = std.ArrayList(usize).init(allocator),
+            .local_closures = std.ArrayList(usize).init(allocator),
+            .local_count = 0,
+            .start = 0,
+            .param = 0,
+            .direct = false,
+            .profile = false,
+            .lines = null,
+            .path = "",
+            .line = 0,
+            .has_frame = false,
+            .lambda_base = lambda_base,
+            .jit_ids = null,
+            .integer = null,
+            .values = std.ArrayList(usize).init(allocator),
+            .params = std.ArrayList(usize).init(allocator),
+        };
+    }
+
+    fn isInteger(self: *CodegenC, start: usize) bool {
+        var lambdas = self.integer orelse return false;
+        return lambdas.integer[start];
+    }
+
+    fn lambdaType(self: *CodegenC, start: usize) !void {
+        if (self.jit_ids) |ids| {
+            try self.writer.print("&lol_types[{d}]", .{ids[start]});
+        } else {
+            try self.writer.print("&lambda_type_{d}", .{self.lambda_base + start});
+        }
+    }
+
+    /// Writes where the binding made by `bind` is stored. For a boxed
+    /// binding that is the reference to its box.
+    fn bindingSlot(self: *CodegenC, bind: usize) !void {
+        if (self.slots.get(bind)) |slot| {
+            try self.writer.print("locals[{d}]", .{slot});
+        } else {
+            var index = std.mem.indexOfScalar(usize, self.free.items, bind).?;
+            try self.writer.print("supEnv(locals[0])->vars[{d}]", .{index});
+        }
+    }
+
+    fn bindingValue(self: *CodegenC, bind: usize) !void {
+        if (self.rpn[bind] == .bind_boxed) {
+            try self.writer.print("supBox(", .{});
+            try self.bindingSlot(bind);
+            try self.writer.print(")->v", .{});
+        } else {
+            try self.bindingSlot(bind);
+        }
+    }
+
+    fn pureValue(self: *CodegenC, end: usize) std.mem.Allocator.Error!void {
+        switch (self.rpn[end]) {
+            .push_number => |n| try self.writer.print("{d}", .{n}),
+            .get_by_bind => |bind| {
+                try self.writer.print("supNumber(", .{});
+                try self.bindingValue(bind);
+                try self.writer.print(")", .{});
+            },
+            .call => {
+                var rhs_end = rpnPrevious(self.rpn, rpnPrevious(self.rpn, end));
+                var rhs_start = pureValueStart(self.rpn, rhs_end);
+                try self.writer.print("(", .{});
+                try self.pureValue(rpnPrevious(self.rpn, rhs_start));
+                try self.writer.print(" {s} ", .{inlineOperatorC(self.rpn, end).?});
+                try self.pureValue(rhs_end);
+                try self.writer.print(")", .{});
+            },
+            else => unreachable,
+        }
+    }
+
+    /// Writes the pending value ending at `end` as a ManagedVariable.
+    fn managedValue(self: *CodegenC, end: usize) !void {
+        switch (self.rpn[end]) {
+            .get_by_bind => |bind| try self.bindingValue(bind),
+            else => {
+                try self.writer.print("supNumberValue(", .{});
+                try self.pureValue(end);
+                try self.writer.print(")", .{});
+            },
+        }
+    }
+
+    /// Calls the _direct function of `callee` with the values it takes
+    /// from `pending`, so neither they nor the callee go through the stack.
+    fn directCall(self: *CodegenC, callee: usize) !void {
+        var args_start = self.pending.len - self.rpn[callee].lambda.arity - 1;
+        var values = self.pending.ends[args_start..self.pending.len];
+        self.pending.len = args_start;
+        try self.flush();
+        try self.writer.writeAll("    ");
+        try writeLambdaFunc(self.writer, self.rpn, self.symbols, self.lambda_base, callee);
+        try self.writer.writeAll("_direct(");
+        for (values, 0..) |end, k| {
+            if (k > 0) {
+                try self.writer.writeAll(", ");
+            }
+            try self.managedValue(end);
+        }
+        try self.writer.writeAll(");\n    supRunTailCalls();\n");
+    }
+
+    fn flush(self: *CodegenC) !void {
+        for (self.pending.ends[0..self.pending.len]) |end| {
+            switch (self.rpn[end]) {
+                .get_by_bind => |bind| {
+                    try self.writer.print("    supPushValue(", .{});
+                    try self.bindingValue(bind);
+                    try self.writer.print(");\n", .{});
+                },
+                else => {
+                    try self.writer.print("    supPushNumber(", .{});
+                    try self.pureValue(end);
+                    try self.writer.print(");\n", .{});
+                },
+            }
+        }
+        self.pending.len = 0;
+    }
+
+    /// Emits the instruction at `i` unless it can be folded into a C expression,
+    /// in which case it is recorded in `pending` and emitted once it is needed.
+    fn typedInstruction(self: *CodegenC, i: usize) !void {
+        var pending = &self.pending;
+        switch (self.rpn[i]) {
+            .push_number, .get_by_bind => {
+                if (pending.len == pending.ends.len) {
+                    try self.flush();
+                }
+                pending.ends[pending.len] = i;
+                pending.len += 1;
+                return;
+            },
+            .get => if (inlineOperatorC(self.rpn, i + 1) != null) {
+                return;
+            },
+            .call => if (inlineOperatorC(self.rpn, i)) |operator| {
+                if (pending.len >= 2) {
+                    pending.len -= 1;
+                    pending.ends[pending.len - 1] = i;
+                } else if (pending.len == 1) {
+                    var rhs = pending.ends[0];
+                    pending.len = 0;
+                    try self.writer.print("    supSetNumber(supNumber(runtime.top) {s} ", .{operator});
+                    try self.pureValue(rhs);
+                    try self.writer.print(");\n", .{});
+                } else {
+                    try self.writer.print("    {{ i64 rhs = supPopNumber(); supSetNumber(supNumber(runtime.top) {s} rhs); }}\n", .{operator});
+                }
+                return;
+            },
+            // Every binding has its own slot in `locals`, so scopes have
+            // no runtime effect.
+            .scope_begin, .scope_end, .placeholder => return,
+            .condition_start => if (pending.len > 0) {
+                pending.len -= 1;
+                var condition = pending.ends[pending.len];
+                try self.flush();
+                try self.writer.print("    if (", .{});
+                try self.pureValue(condition);
+                try self.writer.print(") {{\n", .{});
+                return;
+            },
+            // The callee is the last pending value, its arguments are
+            // right before it.
+            .call_known => |callee| if (self.jit_ids == null and lambdaHasDirect(self.rpn, callee) and pending.len > self.rpn[callee].lambda.arity) {
+                try self.directCall(callee);
+                return;
+            },
+            else => {},
+        }
+        try self.flush();
+        try self.instruction(i);
+    }
+
+    fn newSlot(self: *CodegenC) usize {
+        var slot = self.local_count;
+        self.local_count += 1;
+        return slot;
+    }
+
+    /// The binds right after lambda_context_load are the parameters, they
+    /// take their value from `args` rather than from the stack. Once all of
+    /// them have been read the callee and its arguments are dropped. A
+    /// _direct function takes them from its C parameters, the entry made
+    /// the drop.
+    fn paramBind(self: *CodegenC, i: usize, slot: usize) !bool {
+        var arity = self.rpn[self.start].lambda.arity;
+        if (self.param == arity) {
+            return false;
+        }
+        if (self.rpn[i] == .bind_boxed) {
+            try self.writer.print("    supBoxInto(&locals[{d}], &args[{d}]);\n", .{ slot, self.param });
+        } else if (self.direct) {
+            try self.writer.print("    locals[{d}] = a{d};\n", .{ slot, self.param });
+        } else {
+            try self.writer.print("    locals[{d}] = args[{d}];\n", .{ slot, self.param });
+        }
+        self.param += 1;
+        if (self.param == arity and !self.direct) {
+            try self.writer.print("    supDropCall({d});\n", .{arity});
+        }
+        return true;
+    }
+
+    fn instruction(self: *CodegenC, i: usize) !void {
+        var writer = self.writer;
+        switch (self.rpn[i]) {
+            .lambda_context_load => {
+                if (self.free.items.len > 0) {
+                    try writer.print("    locals[0] = {s};\n", .{if (self.direct) "callee" else "runtime.top"});
+                }
+                self.param = 0;
+                if (self.rpn[self.start].lambda.arity == 0 and !self.direct) {
+                    try writer.print("    supDropCall(0);\n", .{});
+                }
+            },
+            .condition_start => try writer.print("    if (supPopNumber()) {{\n", .{}),
+            .condition_else => try writer.print("    }} else {{\n", .{}),
+            .condition_end => try writer.print("    }}\n", .{}),
+            .bind, .bind_captured => {
+                var slot = self.newSlot();
+                try self.slots.put(i, slot);
+                if (!try self.paramBind(i, slot)) {
+                    try writer.print("    locals[{d}] = runtime.top;\n    supStackDrop();\n", .{slot});
+                }
+            },
+            .bind_boxed => {
+                var slot = self.newSlot();
+                try self.slots.put(i, slot);
+                if (!try self.paramBind(i, slot)) {
+                    try writer.print("    supBindBox(&locals[{d}]);\n", .{slot});
+                }
+            },
+            .set_by_bind => |bind| {
+                try writer.print("    ", .{});
+                try self.bindingValue(bind);
+                try writer.print(" = runtime.top;\n    supStackDrop();\n", .{});
+            },
+            .get => |symbol| {
+                var name = builtinName(self.symbols, symbol);
+                try writer.print("    supPushLambda(&{s});\n", .{name});
+            },
+            .call => |argc| if (isTailCall(self.rpn, i)) {
+                // A call to the lambda itself becomes a loop, any other call
+                // is left to the supCall of the caller, see supTailCall.
+                if (argc == self.rpn[self.start].lambda.arity) {
+                    try writer.print("    if (supType(runtime.top) == ", .{});
+                    try self.lambdaType(self.start);
+                    if (self.direct) {
+                        try writer.print(") {{\n        struct ManagedVariable *next = supArgs({d});\n", .{argc});
+                        for (0..argc) |param| {
+                            try writer.print("        a{d} = next[{d}];\n", .{ param, param });
+                        }
+                        try writer.print("        callee = runtime.top;\n        supDropCall({d});\n        goto entry;\n    }}\n", .{argc});
+                    } else {
+                        try writer.print(") {{\n        args = supArgs({d});\n        goto entry;\n    }}\n", .{argc});
+                    }
+                }
+                if (self.has_frame) {
+                    try writer.print("    runtime.gc_frames = frame.previous;\n", .{});
+                }
+                if (self.profile) {
+                    try writer.print("    supProfileExit(&profile);\n", .{});
+                }
+                try writer.print("    supTailCall({d});\n    return;\n", .{argc});
+            } else {
+                try writer.print("    supCall({d});\n", .{argc});
+            },
+            .call_known => |callee| if (self.jit_ids == null) {
+                try writer.print("    supCallKnown(", .{});
+                try writeLambdaFunc(writer, self.rpn, self.symbols, self.lambda_base, callee);
+                try writer.print(", {d});\n", .{self.rpn[callee].lambda.arity});
+            } else {
+                try writer.print("    supCall({d});\n", .{self.rpn[callee].lambda.arity});
+            },
+            .push_number => |n| try writer.print("    supPushNumber({d});\n", .{n}),
+            .str => |symbol| {
+                try writer.writeAll("    supPushLiteral(&");
+                try writeStringName(writer, self.symbols.nameOf(symbol));
+                try writer.writeAll(");\n");
+            },
+            else => std.debug.panic("attempting to generate unsupported instruction: {any} ", .{self.rpn[i]}),
+        }
+    }
+
+    /// Creates the closure for the lambda at `start` inside the current one,
+    /// copying what it captures into a single environment.
+    fn closure(self: *CodegenC, start: usize) !void {
+        var writer = self.writer;
+        try lambdaFreeVariables(self.rpn, start, &self.nested_free);
+        if (self.nested_free.items.len == 0) {
+            try writer.print("    supPushLambda(", .{});
+            try self.lambdaType(start);
+            try writer.print(");\n", .{});
+            return;
+        }
+        if (std.mem.indexOfScalar(usize, self.local_closures.items, start) != null) {
+            // Laid out like a struct Closure, its header takes two slots.
+            var header = self.newSlot();
+            for (self.nested_free.items) |_| {
+                _ = self.newSlot();
+            }
+            try writer.print("    {{\n        struct Closure *env = (struct Closure *)&locals[{d}];\n        env->type = ", .{header});
+            try self.lambdaType(start);
+            try writer.print(";\n        env->count = {d};\n", .{self.nested_free.items.len});
+            for (self.nested_free.items, 0..) |bind, index| {
+                try writer.print("        env->vars[{d}] = ", .{index});
+                try self.bindingSlot(bind);
+                try writer.print(";\n", .{});
+            }
+            try writer.print("        supPushValue(supObjectValue(env));\n    }}\n", .{});
+            return;
+        }
+        try writer.print("    supPushClosure(", .{});
+        try self.lambdaType(start);
+        try writer.print(", {d});\n", .{self.nested_free.items.len});
+        for (self.nested_free.items, 0..) |bind, index| {
+            try writer.print("    supEnv(runtime.top)->vars[{d}] = ", .{index});
+            try self.bindingSlot(bind);
+            try writer.print(";\n", .{});
+        }
+    }
+
+    /// Finds the closures made by the lambda at `start` that can have their
+    /// environment in its locals, returns the slots they take.
+    fn localClosures(self: *CodegenC, start: usize) !usize {
+        self.local_closures.clearRetainingCapacity();
+        var slots: usize = 0;
+        var i = start + 1;
+        while (i < self.rpn[start].lambda.end) : (i += 1) {
+            var nested = switch (self.rpn[i]) {
+                .lambda => |info| info,
+                else => continue,
+            };
+            try lambdaFreeVariables(self.rpn, i, &self.nested_free);
+            if (self.nested_free.items.len > 0 and closureStaysLocal(self.rpn, start, i)) {
+                try self.local_closures.append(i);
+                slots += 2 + self.nested_free.items.len;
+            }
+            i = nested.end;
+        }
+        return slots;
+    }
+
+    fn lambda(self: *CodegenC, start: usize) !void {
+        var writer = self.writer;
+        var end = self.rpn[start].lambda.end;
+        try lambdaFreeVariables(self.rpn, start, &self.free);
+        // The closure itself is kept in the first slot when it has an environment.
+        var has_env = self.free.items.len > 0;
+        var local_count = lambdaLocalCount(self.rpn, start) + @intFromBool(has_env) + try self.localClosures(start);
+        var has_self_tail_call = lambdaHasSelfTailCall(self.rpn, start);
+        var name = self.lambda_base + start;
+        self.start = start;
+        self.has_frame = local_count > 0;
+        self.pending.len = 0;
+        self.local_count = @intFromBool(has_env);
+        self.slots.clearRetainingCapacity();
+        self.direct = self.jit_ids == null and lambdaHasDirect(self.rpn, start);
+        var arity = self.rpn[start].lambda.arity;
+
+        if (has_self_tail_call and self.jit_ids == null) {
+            try writer.print("struct ManagedType lambda_type_{d};\n", .{name});
+        }
+        if (self.isInteger(start)) {
+            try self.integerLambda(start);
+        }
+        self.line = 0;
+        try self.lineDirective(start);
+        try writer.writeAll("void ");
+        try writeLambdaFunc(writer, self.rpn, self.symbols, self.lambda_base, start);
+        if (self.direct) {
+            try writer.writeAll("_direct(");
+            try writeDirectParams(writer, arity);
+            try writer.writeAll(") {\n");
+        } else {
+            try writer.writeAll("(u64 argc, struct ManagedVariable *args) {\n");
+            try writer.print("    if (!supCheckArity(argc, {d})) {{\n        return;\n    }}\n", .{arity});
+        }
+        if (self.isInteger(start)) {
+            try self.integerEntry(start);
+        }
+        if (local_count > 0) {
+            try writer.print(
+                \\    struct ManagedVariable locals[{d}] = {{0}};
+                \\    struct GCFrame frame = {{ runtime.gc_frames, {d}, locals }};
+                \\    runtime.gc_frames = &frame;
+                \\
+            , .{local_count, local_count});
+        }
+        if (self.profile) {
+            try writer.print("    struct SupProfileFrame profile;\n    supProfileEnter(&profile, &lol_profile_{d});\n", .{name});
+        }
+        // Self tail calls jump back here, the frame stays registered.
+        if (has_self_tail_call) {
+            try writer.print("entry:\n", .{});
+        }
+
+        // Nested lambdas are generated on their own, here they only
+        // become closures.
+        var i = start + 1;
+        while (i < end) : (i += 1) {
+            try self.lineDirective(i);
+            switch (self.rpn[i]) {
+                .lambda => |nested| {
+                    try self.flush();
+                    try self.closure(i);
+                    i = nested.end;
+                },
+                else => try self.typedInstruction(i),
+            }
+        }
+
+        try self.flush();
+        if (local_count > 0) {
+            try writer.print("    runtime.gc_frames = frame.previous;\n", .{});
+        }
+        if (self.profile) {
+            try writer.print("    supProfileExit(&profile);\n", .{});
+        }
+        if (self.jit_ids != null) {
+            try writer.print("}}\n", .{});
+            return;
+        }
+        if (self.direct) {
+            try self.directEntry(start);
+        }
+        try writer.print("}}\nstruct ManagedType lambda_type_{d} = {{\n    \"lambda\",\n    &", .{name});
+        try writeLambdaFunc(writer, self.rpn, self.symbols, self.lambda_base, start);
+        try writer.writeAll("\n};\n");
+    }
+
+    /// Calls the integer function of the lambda at `start` when all the
+    /// arguments are numbers, anything else takes the generic path.
+    fn integerEntry(self: *CodegenC, start: usize) !void {
+        var writer = self.writer;
+        var arity = self.rpn[start].lambda.arity;
+        // A _direct function pushes its result, there is nothing to replace.
+        try writer.writeAll("    if (");
+        if (arity == 0) {
+            try writer.writeAll("true");
+        }
+        for (0..arity) |arg| {
+            try writer.writeAll(if (arg > 0) " && supIsNumber(" else "supIsNumber(");
+            try self.argument(arg);
+            try writer.writeAll(")");
+        }
+        try writer.writeAll(if (self.direct) ") {\n        supPushValue(supNumberValue(" else ") {\n        supReturn(argc, supNumberValue(");
+        try writeLambdaFunc(writer, self.rpn, self.symbols, self.lambda_base, start);
+        try writer.writeAll("_int(");
+        for (0..arity) |arg| {
+            try writer.writeAll(if (arg > 0) ", supNumber(" else "supNumber(");
+            try self.argument(arg);
+            try writer.writeAll(")");
+        }
+        try writer.writeAll(")));\n        return;\n    }\n");
+    }
+
+    /// Writes the argument `arg` of the lambda being generated.
+    fn argument(self: *CodegenC, arg: usize) !void {
+        if (self.direct) {
+            try self.writer.print("a{d}", .{arg});
+        } else {
+            try self.writer.print("args[{d}]", .{arg});
+        }
+    }
+
+    /// Ends the _direct function of the lambda at `start` and starts its
+    /// entry, which checks the arity, takes the callee and the arguments
+    /// off the stack and leaves the rest to the _direct function.
+    fn directEntry(self: *CodegenC, start: usize) !void {
+        var writer = self.writer;
+        var arity = self.rpn[start].lambda.arity;
+        try writer.writeAll("}\nvoid ");
+        try writeLambdaFunc(writer, self.rpn, self.symbols, self.lambda_base, start);
+        try writer.writeAll("(u64 argc, struct ManagedVariable *args) {\n");
+        try writer.print("    if (!supCheckArity(argc, {d})) {{\n        return;\n    }}\n", .{arity});
+        try writer.writeAll("    struct ManagedVariable callee = runtime.top;\n");
+        for (0..arity) |arg| {
+            try writer.print("    struct ManagedVariable a{d} = args[{d}];\n", .{ arg, arg });
+        }
+        try writer.print("    supDropCall({d});\n    ", .{arity});
+        try writeLambdaFunc(writer, self.rpn, self.symbols, self.lambda_base, start);
+        try writer.writeAll("_direct(");
+        for (0..arity) |arg| {
+            try writer.print("a{d}, ", .{arg});
+        }
+        try writer.writeAll("callee);\n");
+    }
+
+    /// Writes the function on plain i64 of an integer lambda, see
+    /// inferIntegerLambdas. Every value gets a C variable of its own, `v`
+    /// and the index of the bind for bindings and `t` and the index of the
+    /// instruction for the rest, the C compiler takes care of the copies.
+    fn integerLambda(self: *CodegenC, start: usize) !void {
+        var writer = self.writer;
+        var rpn = self.rpn;
+        var info = rpn[start].lambda;
+        // Stands in for the value of a self tail call, which never returns.
+        const jumped = std.math.maxInt(usize);
+        self.values.clearRetainingCapacity();
+        self.params.clearRetainingCapacity();
+        var has_self_tail_call = false;
+        for (start + 1..info.end) |i| {
+            switch (rpn[i]) {
+                .bind => if (self.params.items.len < info.arity) {
+                    try self.params.append(i);
+                },
+                else => has_self_tail_call = has_self_tail_call or self.isIntegerSelfTailCall(start, i),
+            }
+        }
+
+        self.line = 0;
+        try self.lineDirective(start);
+        try writer.writeAll("i64 ");
+        try writeLambdaFunc(writer, rpn, self.symbols, self.lambda_base, start);
+        try writer.writeAll("_int(");
+        if (info.arity == 0) {
+            try writer.writeAll("void");
+        }
+        for (self.params.items, 0..) |param, k| {
+            try writer.print("{s}i64 v{d}", .{ if (k > 0) ", " else "", param });
+        }
+        try writer.writeAll(") {\n");
+        // A label cannot come right before a declaration.
+        if (has_self_tail_call) {
+            try writer.writeAll("entry:;\n");
+        }
+
+        var param: usize = 0;
+        var i = start + 1;
+        while (i < info.end) : (i += 1) {
+            try self.lineDirective(i);
+            switch (rpn[i]) {
+                .bind => if (param < info.arity) {
+                    param += 1;
+                } else {
+                    try writer.print("    i64 v{d} = t{d};\n", .{ i, self.values.pop() });
+                },
+                .set_by_bind => |bind| try writer.print("    v{d} = t{d};\n", .{ bind, self.values.pop() }),
+                // Gets of anything else are callees.
+                .get_by_bind => |bind| if (bind > start) {
+                    try writer.print("    i64 t{d} = v{d};\n", .{ i, bind });
+                    try self.values.append(i);
+                },
+                .push_number => |n| {
+                    try writer.print("    i64 t{d} = {d};\n", .{ i, n });
+                    try self.values.append(i);
+                },
+                .call, .call_known => if (inlineOperatorC(rpn, i)) |operator| {
+                    var rhs = self.values.pop();
+                    var lhs = self.values.pop();
+                    try writer.print("    i64 t{d} = t{d} {s} t{d};\n", .{ i, lhs, operator, rhs });
+                    try self.values.append(i);
+                } else {
+                    var callee = self.integer.?.callee(rpn, i).?;
+                    var arity = rpn[callee].lambda.arity;
+                    var args_start = self.values.items.len - arity;
+                    var args = self.values.items[args_start..];
+                    if (self.isIntegerSelfTailCall(start, i)) {
+                        for (self.params.items, args) |p, arg| {
+                            try writer.print("    v{d} = t{d};\n", .{ p, arg });
+                        }
+                        try writer.writeAll("    goto entry;\n");
+                        self.values.shrinkRetainingCapacity(args_start);
+                        try self.values.append(jumped);
+                        continue;
+                    }
+                    try writer.print("    i64 t{d} = ", .{i});
+                    try writeLambdaFunc(writer, rpn, self.symbols, self.lambda_base, callee);
+                    try writer.writeAll("_int(");
+                    for (args, 0..) |arg, k| {
+                        try writer.print("{s}t{d}", .{ if (k > 0) ", " else "", arg });
+                    }
+                    try writer.writeAll(");\n");
+                    self.values.shrinkRetainingCapacity(args_start);
+                    try self.values.append(i);
+                },
+                // The value of a condition is named after its condition_end.
+                .condition_start => |condition_else| {
+                    var condition = self.values.pop();
+                    try writer.print("    i64 t{d};\n    if (t{d}) {{\n", .{ rpn[condition_else].condition_else, condition });
+                },
+                .condition_else => |end| {
+                    try self.integerBranchValue(end, jumped);
+                    try writer.writeAll("    } else {\n");
+                },
+                .condition_end => {
+                    try self.integerBranchValue(i, jumped);
+                    try writer.writeAll("    }\n");
+                    try self.values.append(i);
+                },
+                else => {},
+            }
+        }
+        var result = self.values.pop();
+        if (result != jumped) {
+            try writer.print("    return t{d};\n", .{result});
+        }
+        try writer.writeAll("}\n");
+    }
+
+    /// Whether the instruction at `i` is a tail call of the integer lambda
+    /// at `start` by itself, which integerLambda turns into a goto.
+    fn isIntegerSelfTailCall(self: *CodegenC, start: usize, i: usize) bool {
+        var rpn = self.rpn;
+        if (rpn[i] != .call or inlineOperatorC(rpn, i) != null) {
+            return false;
+        }
+        var callee = self.integer.?.callee(rpn, i) orelse return false;
+        return callee == start and isTailCall(rpn, i);
+    }
+
+    fn integerBranchValue(self: *CodegenC, end: usize, jumped: usize) !void {
+        var value = self.values.pop();
+        if (value != jumped) {
+            try self.writer.print("    t{d} = t{d};\n", .{ end, value });
+        }
+    }
+
+    fn lineDirective(self: *CodegenC, i: usize) !void {
+        var lines = self.lines orelse return;
+        if (lines[i] == self.line) {
+            return;
+        }
+        self.line = lines[i];
+        try self.writer.print("#line {d} \"", .{self.line});
+        try writeEscapedC(self.writer, self.path);
+        try self.writer.writeAll("\"\n");
+    }
+};
+
+/// Generates one lambda into a buffer of its own, so the lambdas of a form
+/// can be generated on several threads and written out in order.
+const LambdaJob = struct {
+    codegen: CodegenC,
+    start: usize,
+    output: std.ArrayList(u8),
+    failed: bool,
+
+    fn run(self: *LambdaJob, wait_group: *std.Thread.WaitGroup) void {
+        defer wait_group.finish();
+        self.codegen.lambda(self.start) catch {
+            self.failed = true;
+        };
+    }
+};
+
+/// Maps the file into memory where possible, so large sources are never
+/// copied. The source stays alive until the compiler exits.
+fn readSourceFile(allocator: std.mem.Allocator, path: []const u8) ![]const u8 {
+    var file = try std.fs.cwd().openFile(path, .{});
+    defer file.close();
+    if (builtin.os.tag == .windows) {
+        return file.readToEndAlloc(allocator, std.math.maxInt(u32));
+    }
+    var size: usize = @intCast((try file.stat()).size);
+    if (size == 0) {
+        return "";
+    }
+    return try std.os.mmap(null, size, std.os.PROT.READ, std.os.MAP.PRIVATE, file.handle, 0);
+}
+
+pub const OutputWriter = std.io.BufferedWriter(1 << 16, std.fs.File.Writer).Writer;
+
+/// What the compiler dumps to stderr while compiling, for debugging.
+const DumpOptions = struct {
+    tokens: bool = false,
+    ast: bool = false,
+    rpn: bool = false,
+};
+
+pub const Phase = enum {
+    tokenize,
+    parse,
+    rpn,
+    resolve,
+    codegen,
+};
+
+/// Bytes allocated and time spent by each phase of the compiler, reported
+/// by --stats and the benchmarks.
+pub const PhaseStats = struct {
+    phase: Phase = .tokenize,
+    bytes: std.EnumArray(Phase, usize) = std.EnumArray(Phase, usize).initFill(0),
+    nanoseconds: std.EnumArray(Phase, u64) = std.EnumArray(Phase, u64).initFill(0),
+    /// When the current phase was entered, 0 while no phase is timed.
+    entered: i128 = 0,
+
+    /// Ends the current phase and starts timing `phase`.
+    fn enter(self: *PhaseStats, phase: Phase) void {
+        self.stop();
+        self.phase = phase;
+        self.entered = std.time.nanoTimestamp();
+    }
+
+    /// Ends the current phase, what is allocated still counts towards it.
+    fn stop(self: *PhaseStats) void {
+        if (self.entered != 0) {
+            self.nanoseconds.getPtr(self.phase).* += @intCast(std.time.nanoTimestamp() - self.entered);
+            self.entered = 0;
+        }
+    }
+
+    fn print(self: *PhaseStats, writer: OutputWriter) !void {
+        var total: usize = 0;
+        var total_nanoseconds: u64 = 0;
+        for (std.enums.values(Phase)) |phase| {
+            var bytes = self.bytes.get(phase);
+            var nanoseconds = self.nanoseconds.get(phase);
+            total += bytes;
+            total_nanoseconds += nanoseconds;
+            try writer.print("{s}: {d} bytes, {d} us\n", .{ @tagName(phase), bytes, nanoseconds / std.time.ns_per_us });
+        }
+        try writer.print("total: {d} bytes, {d} us\n", .{ total, total_nanoseconds / std.time.ns_per_us });
+    }
+};
+
+/// Counts what is allocated through it towards the current phase.
+pub const CountingAllocator = struct {
+    child: std.mem.Allocator,
+    stats: *PhaseStats,
+
+    pub fn allocator(self: *CountingAllocator) std.mem.Allocator {
+        return std.mem.Allocator{
+            .ptr = self,
+            .vtable = &.{
+                .alloc = alloc,
+                .resize = resize,
+                .free = free,
+            },
+        };
+    }
+
+    fn alloc(ctx: *anyopaque, len: usize, log2_align: u8, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        var result = self.child.rawAlloc(len, log2_align, ret_addr) orelse return null;
+        self.stats.bytes.getPtr(self.stats.phase).* += len;
+        return result;
+    }
+
+    fn resize(ctx: *anyopaque, buf: []u8, log2_align: u8, new_len: usize, ret_addr: usize) bool {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        if (!self.child.rawResize(buf, log2_align, new_len, ret_addr)) {
+            return false;
+        }
+        if (new_len > buf.len) {
+            self.stats.bytes.getPtr(self.stats.phase).* += new_len - buf.len;
+        }
+        return true;
+    }
+
+    fn free(ctx: *anyopaque, buf: []u8, log2_align: u8, ret_addr: usize) void {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        self.child.rawFree(buf, log2_align, ret_addr);
+    }
+};
+
+/// Compiles the source one top-level form at a time, so only the memory of
+/// a single form is live. Every form is a lambda, the generated main calls
+/// them in order with argc.
+pub const Compiler = struct {
+    tokenizer: Tokenizer,
+    writer: OutputWriter,
+    emitted_strings: std.AutoHashMap(u32, void),
+    /// The name of the root lambda of every form compiled so far.
+    roots: std.ArrayList(usize),
+    lambda_base: usize,
+    stats: *PhaseStats,
+    dump: DumpOptions,
+    dump_writer: OutputWriter,
+    /// Generates the lambdas of large forms in parallel when set.
+    pool: ?*std.Thread.Pool,
+    /// The file being compiled, for locations in generated code.
+    path: []const u8,
+    /// The source offset of each instruction of the current form, see
+    /// RPNConverter.
+    sources: []const u32,
+    /// Where each line of the source starts, see lineNumbers.
+    line_starts: std.ArrayList(u32),
+    /// Instruments every lambda, see SupProfileSite.
+    profile: bool,
+    /// Where the C of each form is kept when set, so unchanged forms are
+    /// not compiled again, see cachedForm.
+    cache: ?std.fs.Dir,
+    /// The lambda_base of every form so far, see formBase.
+    bases: std.AutoHashMap(usize, void),
+    /// The lines of C written so far, see resetLine.
+    c_line: u32,
+    /// The generated C file, for the #line directive after each form.
+    c_path: []const u8,
+    /// See compilerHash.
+    compiler_hash: u64,
+
+    pub fn init(allocator: std.mem.Allocator, source: []const u8, writer: OutputWriter, stats: *PhaseStats) !Compiler {
+        var tokenizer = try Tokenizer.init(allocator);
+        tokenizer.source = source;
+        return Compiler{
+            .tokenizer = tokenizer,
+            .writer = writer,
+            .emitted_strings = std.AutoHashMap(u32, void).init(allocator),
+            .roots = std.ArrayList(usize).init(allocator),
+            .lambda_base = 0,
+            .stats = stats,
+            .dump = DumpOptions{},
+            .dump_writer = undefined,
+            .pool = null,
+            .path = "<stdin>",
+            .sources = &.{},
+            .line_starts = std.ArrayList(u32).init(allocator),
+            .profile = false,
+            .cache = null,
+            .bases = std.AutoHashMap(usize, void).init(allocator),
+            .c_line = 0,
+            .c_path = "<stdout>",
+            .compiler_hash = compilerHash(),
+        };
+    }
+
+    const Output = std.io.Writer(*Compiler, OutputWriter.Error, writeOutput);
+
+    /// Where the generated C goes, it counts the lines for resetLine.
+    fn output(self: *Compiler) Output {
+        return Output{ .context = self };
+    }
+
+    fn writeOutput(self: *Compiler, bytes: []const u8) OutputWriter.Error!usize {
+        var written = try self.writer.write(bytes);
+        self.c_line += @intCast(std.mem.count(u8, bytes[0..written], "\n"));
+        return written;
+    }
+
+    /// Points the lines after the lambdas of a form back at the C file, so
+    /// what the C compiler says about them is not put on the last line of
+    /// the form.
+    fn resetLine(self: *Compiler) !void {
+        var writer = self.output();
+        // The directive is on the next line, it numbers the one after it.
+        try writer.print("#line {d} \"", .{self.c_line + 2});
+        try writeEscapedC(writer, self.c_path);
+        try writer.writeAll("\"\n");
+    }
+
+    /// Emits every string literal of the current form once as static data,
+    /// so pushing one only stores a pointer. They are found in the tokens,
+    /// so forms taken from the cache emit theirs too.
+    fn stringLiterals(self: *Compiler) !void {
+        var slice = self.tokenizer.tokens.slice();
+        for (slice.items(.tag), slice.items(.symbol)) |tag, symbol| {
+            if (tag != .string or (try self.emitted_strings.getOrPut(symbol)).found_existing) {
+                continue;
+            }
+            var token = self.tokenizer.symbols.nameOf(symbol);
+            var writer = self.output();
+            try writer.writeAll("SUP_STRING_LITERAL(");
+            try writeStringName(writer, token);
+            try writer.writeAll(", ");
+            try writeStringLiteralC(writer, token);
+            try writer.print(");\n", .{});
+        }
+    }
+
+    /// Emits the SupProfileSite of each lambda, named after the binding it is
+    /// let bound to if any.
+    fn profileSites(self: *Compiler, writer: anytype, rpn: []RPN, lines: []const u32, starts: []const usize) !void {
+        for (starts) |start| {
+            try writer.print("struct SupProfileSite lol_profile_{d} = {{ \"", .{self.lambda_base + start});
+            try writeEscapedC(writer, lambdaName(rpn, &self.tokenizer.symbols, start));
+            try writer.writeAll("\", \"");
+            try writeEscapedC(writer, self.path);
+            try writer.print(":{d}\" }};\n", .{lines[start]});
+        }
+    }
+
+    /// The line of the source offset `source`, counting from 1.
+    fn lineOf(self: *Compiler, source: u32) !u32 {
+        if (self.line_starts.items.len == 0) {
+            try self.line_starts.append(0);
+            for (self.tokenizer.source, 0..) |c, i| {
+                if (c == '\n') {
+                    try self.line_starts.append(@intCast(i + 1));
+                }
+            }
+        }
+        // The number of lines starting at or before `source`.
+        var low: usize = 0;
+        var high: usize = self.line_starts.items.len;
+        while (low < high) {
+            var mid = low + (high - low) / 2;
+            if (self.line_starts.items[mid] <= source) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        return @intCast(low);
+    }
+
+    /// The line of each instruction of the current form.
+    fn lineNumbers(self: *Compiler, allocator: std.mem.Allocator, rpn: []RPN) ![]u32 {
+        var lines = try allocator.alloc(u32, rpn.len);
+        for (self.sources, lines) |source, *line| {
+            line.* = try self.lineOf(source);
+        }
+        return lines;
+    }
+
+    /// Picks the lambda_base of the current form from the hash of its
+    /// tokens, so the names in its C stay the same when other forms change.
+    /// Forms with the same tokens get the next free base.
+    fn formBase(self: *Compiler, tokens_hash: u64) !usize {
+        var base: usize = @intCast(tokens_hash & ~@as(u64, std.math.maxInt(u32)));
+        while ((try self.bases.getOrPut(base)).found_existing) {
+            base +%= 1 << 32;
+        }
+        return base;
+    }
+
+    /// Hashes the tokens of the current form and the lines between them,
+    /// which end up in its #line directives. Only where the whole form
+    /// starts is left out, cachedForm moves the directives for that.
+    fn tokensHash(self: *Compiler) u64 {
+        var hasher = std.hash.Wyhash.init(0);
+        var slice = self.tokenizer.tokens.slice();
+        var previous_end = slice.items(.index)[0];
+        for (slice.items(.tag), slice.items(.index), slice.items(.len)) |tag, index, len| {
+            var lines: u32 = @intCast(std.mem.count(u8, self.tokenizer.source[previous_end..index], "\n"));
+            previous_end = index + len;
+            hasher.update(std.mem.asBytes(&lines));
+            hasher.update(std.mem.asBytes(&tag));
+            hasher.update(std.mem.asBytes(&len));
+            hasher.update(self.tokenizer.source[index .. index + len]);
+        }
+        return hasher.final();
+    }
+
+    /// The cache file of the C of the current form. Everything but the
+    /// lines of the form goes into its name, see cachedForm.
+    fn formCacheName(self: *Compiler, allocator: std.mem.Allocator, tokens_hash: u64, first_line: u32) ![]const u8 {
+        var hasher = std.hash.Wyhash.init(0);
+        hasher.update(std.mem.asBytes(&self.compiler_hash));
+        hasher.update(std.mem.asBytes(&tokens_hash));
+        hasher.update(std.mem.asBytes(&self.lambda_base));
+        hasher.update(self.path);
+        hasher.update(std.mem.asBytes(&self.profile));
+        // Profile sites hold the line of their lambda.
+        if (self.profile) {
+            hasher.update(std.mem.asBytes(&first_line));
+        }
+        return std.fmt.allocPrint(allocator, "form-{x:0>16}.c", .{hasher.final()});
+    }
+
+    /// Writes the C of the current form from the cache if it is there. The
+    /// file starts with the line the form started on when it was generated,
+    /// the #line directives are moved by as many lines as the form moved.
+    /// A file that does not read like that is a miss.
+    fn cachedForm(self: *Compiler, allocator: std.mem.Allocator, name: []const u8, first_line: u32) !bool {
+        var cache = self.cache orelse return false;
+        var fragment = cache.readFileAlloc(allocator, name, std.math.maxInt(u32)) catch |err| switch (err) {
+            error.FileNotFound => return false,
+            else => return err,
+        };
+        var lines = std.mem.splitScalar(u8, fragment, '\n');
+        var header = lines.first();
+        if (!std.mem.startsWith(u8, header, "// line ")) {
+            return false;
+        }
+        var generated_line = std.fmt.parseInt(i64, header["// line ".len..], 10) catch return false;
+        var offset = @as(i64, first_line) - generated_line;
+        // Nothing is written until every #line was read, a bad one is a miss.
+        var moved = std.ArrayList(u8).init(allocator);
+        var writer = moved.writer();
+        while (lines.next()) |line| {
+            if (!std.mem.startsWith(u8, line, "#line ")) {
+                try writer.writeAll(line);
+            } else {
+                var number_end = std.mem.indexOfScalarPos(u8, line, "#line ".len, ' ') orelse line.len;
+                var number = std.fmt.parseInt(i64, line["#line ".len..number_end], 10) catch return false;
+                try writer.print("#line {d}{s}", .{ number + offset, line[number_end..] });
+            }
+            if (lines.index != null) {
+                try writer.writeByte('\n');
+            }
+        }
+        try self.output().writeAll(moved.items);
+        return true;
+    }
+
+    /// Keeps the C of the current form in the cache. It is written to a
+    /// temporary file first, so another compiler never reads half of it.
+    fn storeForm(self: *Compiler, name: []const u8, first_line: u32, fragment: []const u8) !void {
+        var cache = self.cache orelse return;
+        var file = try cache.atomicFile(name, .{});
+        defer file.deinit();
+        try file.file.writer().print("// line {d}\n", .{first_line});
+        try file.file.writeAll(fragment);
+        try file.finish();
+    }
+
+    /// Generates the lambdas starting at `lambdas`, innermost first since
+    /// every lambda refers to the types of the ones nested in it.
+    fn lambdas(self: *Compiler, allocator: std.mem.Allocator, rpn: []RPN, starts: []const usize, integer: ?*const IntegerLambdas, writer: std.ArrayList(u8).Writer) !void {
+        var lines = try self.lineNumbers(allocator, rpn);
+        // Spreading a handful of lambdas over threads costs more than it saves.
+        const parallel_threshold = 64;
+        var pool = if (starts.len >= parallel_threshold) self.pool else null;
+        var thread_safe = std.heap.ThreadSafeAllocator{ .child_allocator = allocator };
+        var job_allocator = if (pool != null) thread_safe.allocator() else allocator;
+
+        var jobs = try allocator.alloc(LambdaJob, starts.len);
+        var wait_group = std.Thread.WaitGroup{};
+        for (jobs, starts) |*job, start| {
+            job.* = LambdaJob{
+                .codegen = undefined,
+                .start = start,
+                .output = std.ArrayList(u8).init(job_allocator),
+                .failed = false,
+            };
+            job.codegen = CodegenC.init(job_allocator, rpn, &self.tokenizer.symbols, self.lambda_base, job.output.writer());
+            job.codegen.profile = self.profile;
+            job.codegen.integer = integer;
+            job.codegen.lines = lines;
+            job.codegen.path = self.path;
+            wait_group.start();
+            if (pool) |p| {
+                p.spawn(LambdaJob.run, .{ job, &wait_group }) catch job.run(&wait_group);
+            } else {
+                job.run(&wait_group);
+            }
+        }
+        wait_group.wait();
+
+        if (self.profile) {
+            try self.profileSites(writer, rpn, lines, starts);
+        }
+        // Known callees are called by name, possibly before their definition.
+        for (starts) |start| {
+            try writer.writeAll("void ");
+            try writeLambdaFunc(writer, rpn, &self.tokenizer.symbols, self.lambda_base, start);
+            try writer.writeAll("(u64 argc, struct ManagedVariable *args);\n");
+            if (lambdaHasDirect(rpn, start)) {
+                try writer.writeAll("void ");
+                try writeLambdaFunc(writer, rpn, &self.tokenizer.symbols, self.lambda_base, start);
+                try writer.writeAll("_direct(");
+                try writeDirectParams(writer, rpn[start].lambda.arity);
+                try writer.writeAll(");\n");
+            }
+            if (integer != null and integer.?.integer[start]) {
+                try writer.writeAll("i64 ");
+                try writeLambdaFunc(writer, rpn, &self.tokenizer.symbols, self.lambda_base, start);
+                try writer.writeAll("_int(");
+                var arity = rpn[start].lambda.arity;
+                if (arity == 0) {
+                    try writer.writeAll("void");
+                }
+                for (0..arity) |param| {
+                    try writer.writeAll(if (param > 0) ", i64" else "i64");
+                }
+                try writer.writeAll(");\n");
+            }
+        }
+        var i = jobs.len;
+        while (i > 0) {
+            i -= 1;
+            if (jobs[i].failed) {
+                return error.OutOfMemory;
+            }
+            try writer.writeAll(jobs[i].output.items);
+        }
+    }
+
+    /// Compiles the next form with memory from `allocator`, which can be
+    /// freed once it returns. Returns false at the end of the source.
+    fn compileForm(self: *Compiler, allocator: std.mem.Allocator) !bool {
+        if (!try self.nextForm(allocator)) {
+            return false;
+        }
+        self.stats.enter(.codegen);
+        var tokens_hash = self.tokensHash();
+        self.lambda_base = try self.formBase(tokens_hash);
+        try self.roots.append(self.lambda_base);
+        try self.stringLiterals();
+        var first_line = try self.lineOf(self.tokenizer.tokens.items(.index)[0]);
+        var name = try self.formCacheName(allocator, tokens_hash, first_line);
+        // Dumps are made while the form goes through the phases.
+        var dumping = self.dump.tokens or self.dump.ast or self.dump.rpn;
+        if (!dumping and try self.cachedForm(allocator, name, first_line)) {
+            try self.resetLine();
+            self.stats.stop();
+            return true;
+        }
+
+        var rpn = try self.formRPN(allocator);
+        self.stats.enter(.resolve);
+        try resolveKnownCallees(allocator, rpn);
+        var lambda_starts = std.ArrayList(usize).init(allocator);
+        try rpnFindLambdas(rpn, &lambda_starts);
+        // The integer function of a lambda would skip its profiling.
+        var integer = if (self.profile) null else try inferIntegerLambdas(allocator, rpn);
+
+        self.stats.enter(.codegen);
+        var fragment = std.ArrayList(u8).init(allocator);
+        try self.lambdas(allocator, rpn, lambda_starts.items, if (integer) |*inferred| inferred else null, fragment.writer());
+        try self.output().writeAll(fragment.items);
+        try self.resetLine();
+        try self.storeForm(name, first_line, fragment.items);
+        self.stats.stop();
+        return true;
+    }
+
+    /// Compiles every form of the source and the main calling them, the
+    /// arena behind `form_allocator` is reset before each form.
+    pub fn compileProgram(self: *Compiler, form_arena: *std.heap.ArenaAllocator, form_allocator: std.mem.Allocator) !void {
+        try self.output().print("#include \"support.h\"\n", .{});
+        while (true) {
+            _ = form_arena.reset(.retain_capacity);
+            if (!try self.compileForm(form_allocator)) {
+                break;
+            }
+        }
+        try self.writeMain();
+    }
+
+    /// Runs every phase up to code generation on the next form, see
+    /// compileForm. Returns null at the end of the source.
+    fn nextFormRPN(self: *Compiler, allocator: std.mem.Allocator) !?[]RPN {
+        if (!try self.nextForm(allocator)) {
+            return null;
+        }
+        return try self.formRPN(allocator);
+    }
+
+    /// Tokenizes the next form, returns false at the end of the source.
+    fn nextForm(self: *Compiler, allocator: std.mem.Allocator) !bool {
+        var tokenizer = &self.tokenizer;
+        self.stats.enter(.tokenize);
+        defer self.stats.stop();
+        if (!try tokenizer.nextForm(allocator)) {
+            return false;
+        }
+        if (self.dump.tokens) {
+            var slice = tokenizer.tokens.slice();
+            for (slice.items(.tag), slice.items(.index)) |tag, index| {
+                try self.dump_writer.print("// {any} at {d}\n", .{ tag, index });
+            }
+        }
+        return true;
+    }
+
+    /// Runs the phases after the tokenizer on the form nextForm tokenized.
+    fn formRPN(self: *Compiler, allocator: std.mem.Allocator) ![]RPN {
+        var tokenizer = &self.tokenizer;
+        var slice = tokenizer.tokens.slice();
+
+        // There is at most one node per token.
+        self.stats.enter(.parse);
+        var parser = Parser.init(allocator);
+        try parser.nodes.ensureTotalCapacity(allocator, slice.len);
+        var start = try parser.parseExpr(&slice);
+        if (self.dump.ast) {
+            try self.dump_writer.writeAll("// ");
+            try parser.prettyPrint(start, self.dump_writer);
+            try self.dump_writer.writeAll("\n");
+        }
+
+        self.stats.enter(.rpn);
+        var rpnConverter = RPNConverter {
+            .symbols = &tokenizer.symbols,
+            .rpn = std.ArrayList(RPN).init(allocator),
+            .parser = &parser,
+            .sources = std.ArrayList(u32).init(allocator),
+            .source = 0,
+        };
+        try rpnConverter.rpn.ensureTotalCapacity(parser.nodes.len + parser.nodes.len / 2);
+        try rpnConverter.sources.ensureTotalCapacity(rpnConverter.rpn.capacity);
+        try rpnConverter.exprToRPN(start);
+        var rpn = rpnConverter.rpn.items;
+        self.sources = rpnConverter.sources.items;
+        if (rpn.len == 0 or rpn[0] != .lambda) {
+            @panic("top-level forms have to be lambdas");
+        }
+        inlineAppliedLambdas(rpn);
+        self.stats.enter(.resolve);
+        var resolver = try Resolver.init(allocator, &tokenizer.symbols);
+        try resolver.resolve(rpn);
+        foldConstants(rpn);
+
+        if (self.dump.rpn) {
+            try self.dump_writer.print("// RPN: {any}\n", .{rpn});
+        }
+        self.stats.stop();
+        return rpn;
+    }
+
+    fn writeMain(self: *Compiler) !void {
+        var writer = self.output();
+        try writer.print(
+            \\int main(int argc, const char **args) {{
+            \\    program_args = args;
+            \\    program_args_count = argc;
+            \\    supRuntimeInit();
+            \\
+        , .{});
+        // Set up front, so a fatal error writes the profile too.
+        if (self.profile) {
+            try writer.print("    profile_path = \"profile.folded\";\n", .{});
+        }
+        for (self.roots.items, 0..) |root, i| {
+            if (i > 0) {
+                try writer.print("    supStackDrop();\n", .{});
+            }
+            try writer.print(
+                \\    supPushNumber(argc);
+                \\    supPushLambda(&lambda_type_{d});
+                \\    supCall(1);
+                \\
+            , .{root});
+        }
+        try writer.print("    supFlushOutput();\n", .{});
+        if (self.profile) {
+            try writer.print("    supProfileWrite(profile_path);\n", .{});
+        }
+        try writer.print(
+            \\    return supNumber(runtime.top);
+            \\}}
+            \\
+        , .{});
+    }
+};
+
+const support_header = @embedFile("support.h");
+const support_source = @embedFile("support.c");
+/// Cached C is only valid for the compiler and runtime it was generated by.
+/// Too much to hash at comptime.
+fn compilerHash() u64 {
+    var hasher = std.hash.Wyhash.init(0);
+    hasher.update(@embedFile("main.zig"));
+    hasher.update(support_header);
+    return hasher.final();
+}
+
+/// Turns generated C into an executable with the C compiler. What it builds
+/// is kept in a cache directory, named by the hash of what it was built
+/// from, so neither support.c nor an unchanged program is compiled twice.
+pub const Driver = struct {
+    allocator: std.mem.Allocator,
+    cache: std.fs.Dir,
+    cc: []const u8,
+
+    pub fn init(allocator: std.mem.Allocator) !Driver {
+        var cache_path: []const u8 = std.process.getEnvVarOwned(allocator, "LOL_CACHE_DIR") catch |err| switch (err) {
+            error.EnvironmentVariableNotFound => ".lol-cache",
+            else => return err,
+        };
+        var cc: []const u8 = std.process.getEnvVarOwned(allocator, "CC") catch |err| switch (err) {
+            error.EnvironmentVariableNotFound => "cc",
+            else => return err,
+        };
+        return Driver{
+            .allocator = allocator,
+            .cache = try std.fs.cwd().makeOpenPath(cache_path, .{}),
+            .cc = cc,
+        };
     }
-    if (std.mem.eql(u8, sym, "or")) {
-        return "sup_builtin_bitwise_or";
+
+    fn hashedName(self: *Driver, prefix: []const u8, parts: []const []const u8, extension: []const u8) ![]const u8 {
+        var hasher = std.hash.Wyhash.init(0);
+        for (parts) |part| {
+            hasher.update(part);
+        }
+        return std.fmt.allocPrint(self.allocator, "{s}-{x:0>16}{s}", .{ prefix, hasher.final(), extension });
     }
-    if (std.mem.eql(u8, sym, "and")) {
-        return "sup_builtin_bitwise_and";
+
+    fn cached(self: *Driver, name: []const u8) bool {
+        self.cache.access(name, .{}) catch return false;
+        return true;
     }
-    if (std.mem.eql(u8, sym, "<")) {
-        return "sup_builtin_less_than";
+
+    fn runCC(self: *Driver, argv: []const []const u8) !void {
+        var child = std.ChildProcess.init(argv, self.allocator);
+        child.cwd_dir = self.cache;
+        var term = try child.spawnAndWait();
+        if (term != .Exited or term.Exited != 0) {
+            return error.CCompilerFailed;
+        }
     }
-    if (std.mem.eql(u8, sym, "prog-arg")) {
-        return "sup_builtin_program_argument";
+
+    /// Builds `c` as a shared library and returns its absolute path, the
+    /// undefined symbols are resolved against the executable.
+    fn buildShared(self: *Driver, c: []const u8) ![]const u8 {
+        var library = try self.hashedName("jit", &.{ c, support_header, self.cc }, builtin.target.dynamicLibSuffix());
+        if (!self.cached(library)) {
+            try self.cache.writeFile("support.h", support_header);
+            var source = try self.hashedName("jit", &.{c}, ".c");
+            try self.cache.writeFile(source, c);
+            try self.runCC(&.{ self.cc, "-O2", "-fPIC", "-shared", "-I.", source, "-o", library });
+        }
+        return self.cache.realpathAlloc(self.allocator, library);
     }
-    if (std.mem.eql(u8, sym, "str-to-num")) {
-        return "sup_builtin_string_to_number";
+
+    /// Where the generated C is written before its hash is known.
+    pub fn createSource(self: *Driver) !std.fs.File {
+        return self.cache.createFile("program.c", .{});
     }
-    if (std.mem.eql(u8, sym, "num-to-str")) {
-        return "sup_builtin_number_to_string";
+
+    /// Builds the C in program.c, it has to be closed.
+    pub fn build(self: *Driver, output: []const u8) !void {
+        try self.cache.writeFile("support.h", support_header);
+        var support_object = try self.hashedName("support", &.{ support_header, support_source, self.cc }, ".o");
+        if (!self.cached(support_object)) {
+            try self.cache.writeFile("support.c", support_source);
+            try self.runCC(&.{ self.cc, "-O2", "-I.", "-c", "support.c", "-o", support_object });
+        }
+
+        var program = try self.cache.readFileAlloc(self.allocator, "program.c", std.math.maxInt(u32));
+        var source = try self.hashedName("program", &.{program}, ".c");
+        var exe = try self.hashedName("program", &.{ program, support_object }, builtin.target.exeFileExt());
+        if (!self.cached(exe)) {
+            try self.cache.rename("program.c", source);
+            try self.runCC(&.{ self.cc, "-O2", "-I.", source, support_object, "-o", exe });
+        }
+        try self.cache.copyFile(exe, std.fs.cwd(), output, .{});
     }
-    if (std.mem.eql(u8, sym, "put-str")) {
-        return "sup_builtin_put_string";
+};
+
+/// Decodes a string token the way a C compiler reads the literal that
+/// writeStringLiteralC makes of it.
+fn unescapeString(allocator: std.mem.Allocator, token: []const u8) ![]u8 {
+    var bytes = std.ArrayList(u8).init(allocator);
+    var i: usize = 1;
+    while (i < token.len - 1) : (i += 1) {
+        if (token[i] != '\\' or i + 2 >= token.len) {
+            try bytes.append(token[i]);
+            continue;
+        }
+        i += 1;
+        var c = token[i];
+        switch (c) {
+            'n' => try bytes.append('\n'),
+            'r' => try bytes.append('\r'),
+            't' => try bytes.append('\t'),
+            'a' => try bytes.append(0x07),
+            'b' => try bytes.append(0x08),
+            'f' => try bytes.append(0x0c),
+            'v' => try bytes.append(0x0b),
+            'x' => {
+                var value: u8 = 0;
+                while (i + 1 < token.len - 1 and std.ascii.isHex(token[i + 1])) : (i += 1) {
+                    value = value *% 16 +% (std.fmt.charToDigit(token[i + 1], 16) catch unreachable);
+                }
+                try bytes.append(value);
+            },
+            '0'...'7' => {
+                var value: u8 = c - '0';
+                var digits: usize = 1;
+                while (digits < 3 and i + 1 < token.len - 1 and token[i + 1] >= '0' and token[i + 1] <= '7') : (digits += 1) {
+                    i += 1;
+                    value = value *% 8 +% (token[i] - '0');
+                }
+                try bytes.append(value);
+            },
+            else => try bytes.append(c),
+        }
     }
+    return bytes.items;
+}
+
+/// What the interpreter runs, decoded from the RPN of one lambda. Slots
+/// index the locals of the running lambda and indices the environment of
+/// its closure, the same way CodegenC lays them out.
+const Op = union(enum) {
+    push_number: i64,
+    push_literal: *const anyopaque,
+    push_builtin: *support.ManagedType,
+    /// Index into Interpreter.closures.
+    push_closure: u32,
+    push_local: u32,
+    push_local_boxed: u32,
+    push_env: u32,
+    push_env_boxed: u32,
+    set_local: u32,
+    set_local_boxed: u32,
+    set_env: u32,
+    set_env_boxed: u32,
+    bind_boxed: u32,
+    /// Binds a parameter, see CodegenC.paramBind.
+    bind_arg: ArgBind,
+    bind_arg_boxed: ArgBind,
+    load_env,
+    /// Drops the callee and this many arguments.
+    drop_call: u32,
+    /// A call to a builtin that has an inline operator, on two numbers.
+    operator: *const fn (i64, i64) i64,
+    /// The number of arguments.
+    call: u32,
+    tail_call: u32,
+    jump_if_false: u32,
+    jump: u32,
+    ret,
+};
+
+const ArgBind = struct {
+    slot: u32,
+    arg: u32,
+};
+
+const InterpretedLambda = struct {
+    code_start: u32,
+    local_count: u32,
+    arity: u32,
+};
+
+/// Where a closure gets a captured binding from, see CodegenC.closure.
+const Capture = struct {
+    env: bool,
+    index: u32,
+};
+
+const ClosureSite = struct {
+    lambda: u32,
+    captures: []Capture,
+};
 
+threadlocal var current_interpreter: ?*Interpreter = null;
 
-    std.debug.panic("unknown primitive: {s}", .{sym});
+/// The function of every interpreted lambda type, so supCall and the
+/// tail call trampoline work the same as for generated code.
+fn interpretedLambdaEntry(argc: u64, args: [*c]support.ManagedVariable) callconv(.C) void {
+    var interpreter = current_interpreter.?;
+    var offset = @intFromPtr(support.supType(support.runtime.top)) - @intFromPtr(interpreter.types.ptr);
+    interpreter.call(@intCast(offset / @sizeOf(support.ManagedType)), argc, args);
 }
 
-fn codegenInstructionC(rpn: []RPN, i: usize, writer: *std.ArrayList(u8).Writer) !void {
-    switch (rpn[i]) {
-        .lambda_context_load => try writer.print(
-            \\    context_stack = top.v.context;
-            \\    supStackDrop();
-            \\
-            , .{}),
-        .condition_start => try writer.print("    if (top.v.number) {{\n    supStackDrop();\n", .{}),
-        .condition_else => try writer.print("    }} else {{\n    supStackDrop();\n", .{}),
-        .condition_end => try writer.print("    }}\n", .{}),
-        .bind => try writer.print("    supBind();\n", .{}),
-        .bind_captured => try writer.print("    supBindCaptured();\n", .{}),
-        .set_by_hops => |hops| try writer.print("    supSet({d});\n", .{hops}),
-        .set_captured_by_hops => |hops| try writer.print("    supSetCaptured({d});\n", .{hops}),
-        .get_by_hops => |hops| try writer.print("    supGet({d});\n", .{hops}),
-        .get_captured_by_hops => |hops| try writer.print("    supGetCaptured({d});\n", .{hops}),
-        .get => |sym| {
-            var name = builtinName(sym);
-            try writer.print("    supPushLambda(&{s});\n", .{name});
-        },
-        .call => try writer.print("    supCall();\n", .{}),
-        .push_number => |n| try writer.print("    supPushNumber({d});\n", .{n}),
-        .scope_begin => |id| {
-            try writer.print(
-                \\    struct HeapVariable *scope_{d}_context = context_stack;
-                \\    BindsIndex scope_{d}_binds_index = binds_index;
-                \\
-            , .{id, id});
-        },
-        .scope_end => |id| {
-            try writer.print(
-                \\    context_stack = scope_{d}_context;
-                \\    binds_index = scope_{d}_binds_index;
-                \\
-            , .{id, id});
-        },
-        else => std.debug.panic("attempting to generate unsupported instruction: {any} ", .{rpn[i]}),
+const LambdaFunc = *const fn (u64, [*c]support.ManagedVariable) callconv(.C) void;
+
+/// Runs the RPN of a form in process, on the runtime from support.c,
+/// instead of generating C for it.
+const Interpreter = struct {
+    /// The locals of every running lambda, the interpreter version of the
+    /// `locals` arrays of generated code.
+    locals: []support.ManagedVariable,
+    locals_len: usize,
+    // Decoded from the form that is running, see load.
+    code: std.ArrayList(Op),
+    lambdas: []InterpretedLambda,
+    types: []support.ManagedType,
+    closures: std.ArrayList(ClosureSite),
+    // Kept for compiling hot lambdas, see compile.
+    allocator: std.mem.Allocator,
+    rpn: []RPN,
+    symbols: *const SymbolTable,
+    starts: []usize,
+    ids: []u32,
+    /// How often each lambda has been interpreted.
+    counts: []u32,
+    /// Compiles lambdas once they have been called `jit_threshold` times
+    /// when set.
+    driver: ?*Driver,
+    jit_threshold: u32,
+
+    fn init(allocator: std.mem.Allocator) !Interpreter {
+        support.supRuntimeInit();
+        return Interpreter{
+            .locals = try allocator.alloc(support.ManagedVariable, 1 << 20),
+            .locals_len = 0,
+            .code = undefined,
+            .lambdas = &.{},
+            .types = &.{},
+            .closures = undefined,
+            .allocator = allocator,
+            .rpn = &.{},
+            .symbols = undefined,
+            .starts = &.{},
+            .ids = &.{},
+            .counts = &.{},
+            .driver = null,
+            .jit_threshold = 1000,
+        };
+    }
+
+    /// Decodes every lambda of `rpn`, with memory from `allocator` that
+    /// has to live until the form has run.
+    fn load(self: *Interpreter, allocator: std.mem.Allocator, symbols: *const SymbolTable, rpn: []RPN) !void {
+        var starts = std.ArrayList(usize).init(allocator);
+        try rpnFindLambdas(rpn, &starts);
+        var ids = try allocator.alloc(u32, rpn.len);
+        for (starts.items, 0..) |start, id| {
+            ids[start] = @intCast(id);
+        }
+        self.code = std.ArrayList(Op).init(allocator);
+        self.closures = std.ArrayList(ClosureSite).init(allocator);
+        self.lambdas = try allocator.alloc(InterpretedLambda, starts.items.len);
+        self.types = try allocator.alloc(support.ManagedType, starts.items.len);
+        for (self.types) |*t| {
+            t.* = support.ManagedType{ .name = "lambda", .func = @ptrCast(&interpretedLambdaEntry) };
+        }
+        self.counts = try allocator.alloc(u32, starts.items.len);
+        @memset(self.counts, 0);
+        self.allocator = allocator;
+        self.rpn = rpn;
+        self.symbols = symbols;
+        self.starts = starts.items;
+        self.ids = ids;
+
+        var decoder = LambdaDecoder{
+            .interpreter = self,
+            .allocator = allocator,
+            .symbols = symbols,
+            .rpn = rpn,
+            .ids = ids,
+            .code_index = try allocator.alloc(u32, rpn.len + 1),
+            .slots = std.AutoHashMap(usize, u32).init(allocator),
+            .free = std.ArrayList(usize).init(allocator),
+            .jumps = std.ArrayList(usize).init(allocator),
+        };
+        for (starts.items, 0..) |start, id| {
+            self.lambdas[id] = try decoder.decode(start);
+        }
     }
-}
 
+    /// Calls the root lambda of the loaded form with `argc`, the result is
+    /// left in top like after supCall.
+    fn runRoot(self: *Interpreter, argc: i64) void {
+        current_interpreter = self;
+        support.supPushNumber(argc);
+        support.supPushLambda(&self.types[0]);
+        support.supCall(1);
+    }
 
-fn codegenC(rpn: []RPN, start: usize, writer: *std.ArrayList(u8).Writer) !void {
-    // TODO: Don't count depth, instead search for the end using ID as that is more robust.
-    var depth: usize = 0;
-    for(start..rpn.len) |i| {
-        switch (rpn[i]) {
-            .lambda => {
-                if (depth != 0) {
-                    try writer.print("    supPushLambda(&lambda_type_{d});\n", .{i});
-                } else {
-                    try writer.print("void genLambda{d}() {{\n", .{start});
-                }
-                depth += 1;
-            },
-            .lambda_ret => {
-                if (depth == 1) {
-                    try writer.print(
-                        \\}}
-                        \\struct ManagedType lambda_type_{d} = {{
-                        \\    "lambda",
-                        \\    &genLambda{d}
-                        \\}};
-                        \\
-                    , .{start, start});
+    /// Generates C for the lambda `id` on its own, loads it as a shared
+    /// library and points the type of the lambda at it, so from then on
+    /// every call of the lambda runs compiled code.
+    fn compile(self: *Interpreter, id: u32) !LambdaFunc {
+        var start = self.starts[id];
+        var c = std.ArrayList(u8).init(self.allocator);
+        var writer = c.writer();
+        try writer.writeAll("#include \"support.h\"\nstruct ManagedType *lol_types;\n");
+        var strings = std.AutoHashMap(u32, void).init(self.allocator);
+        for (self.rpn[start..self.rpn[start].lambda.end]) |instruction| {
+            switch (instruction) {
+                .str => |symbol| {
+                    if ((try strings.getOrPut(symbol)).found_existing) {
+                        continue;
+                    }
+                    try writer.writeAll("SUP_STRING_LITERAL(");
+                    try writeStringName(writer, self.symbols.nameOf(symbol));
+                    try writer.writeAll(", ");
+                    try writeStringLiteralC(writer, self.symbols.nameOf(symbol));
+                    try writer.print(");\n", .{});
+                },
+                else => {},
+            }
+        }
+        var codegen = CodegenC.init(self.allocator, self.rpn, self.symbols, 0, writer);
+        codegen.jit_ids = self.ids;
+        try codegen.lambda(start);
+
+        var path = try self.driver.?.buildShared(c.items);
+        var library = try std.DynLib.open(path);
+        var types = library.lookup(*[*c]support.ManagedType, "lol_types") orelse return error.MissingSymbol;
+        types.* = self.types.ptr;
+        var name = std.ArrayList(u8).init(self.allocator);
+        try writeLambdaFunc(name.writer(), self.rpn, self.symbols, 0, start);
+        try name.append(0);
+        var func = library.lookup(LambdaFunc, name.items[0 .. name.items.len - 1 :0]) orelse return error.MissingSymbol;
+        self.types[id].func = @ptrCast(func);
+        return func;
+    }
+
+    fn call(self: *Interpreter, id: u32, argc: u64, call_args: [*c]support.ManagedVariable) void {
+        self.counts[id] +%= 1;
+        if (self.counts[id] == self.jit_threshold and self.driver != null) {
+            if (self.compile(id)) |func| {
+                func(argc, call_args);
+                return;
+            } else |err| {
+                std.debug.print("could not compile lambda {d}: {s}\n", .{ self.starts[id], @errorName(err) });
+            }
+        }
+
+        var lambda = self.lambdas[id];
+        if (!support.supCheckArity(argc, lambda.arity)) {
+            return;
+        }
+        var args = call_args;
+        var base = self.locals_len;
+        if (base + lambda.local_count > self.locals.len) {
+            support.fatalError("interpreter stack overflow");
+            return;
+        }
+        var locals = self.locals[base .. base + lambda.local_count];
+        @memset(locals, std.mem.zeroes(support.ManagedVariable));
+        self.locals_len += locals.len;
+        defer self.locals_len = base;
+        var frame = support.GCFrame{
+            .previous = support.runtime.gc_frames,
+            .count = locals.len,
+            .locals = locals.ptr,
+        };
+        support.runtime.gc_frames = &frame;
+        defer support.runtime.gc_frames = frame.previous;
+
+        var pc: usize = lambda.code_start;
+        while (true) {
+            var op = self.code.items[pc];
+            pc += 1;
+            switch (op) {
+                .push_number => |n| support.supPushNumber(n),
+                .push_literal => |literal| support.supPushLiteral(literal),
+                .push_builtin => |builtin_type| support.supPushLambda(builtin_type),
+                .push_closure => |site| self.pushClosure(self.closures.items[site], locals),
+                .push_local => |slot| support.supPushValue(locals[slot]),
+                .push_local_boxed => |slot| support.supPushValue(support.supBox(locals[slot]).*.v),
+                .push_env => |index| support.supPushValue(support.supEnv(locals[0]).*.vars()[index]),
+                .push_env_boxed => |index| support.supPushValue(support.supBox(support.supEnv(locals[0]).*.vars()[index]).*.v),
+                .set_local => |slot| {
+                    locals[slot] = support.runtime.top;
+                    support.supStackDrop();
+                },
+                .set_local_boxed => |slot| {
+                    support.supBox(locals[slot]).*.v = support.runtime.top;
+                    support.supStackDrop();
+                },
+                .set_env => |index| {
+                    support.supEnv(locals[0]).*.vars()[index] = support.runtime.top;
+                    support.supStackDrop();
+                },
+                .set_env_boxed => |index| {
+                    support.supBox(support.supEnv(locals[0]).*.vars()[index]).*.v = support.runtime.top;
+                    support.supStackDrop();
+                },
+                .bind_boxed => |slot| support.supBindBox(&locals[slot]),
+                .bind_arg => |bind| locals[bind.slot] = args[bind.arg],
+                .bind_arg_boxed => |bind| support.supBoxInto(&locals[bind.slot], &args[bind.arg]),
+                .load_env => locals[0] = support.runtime.top,
+                .drop_call => |count| support.supDropCall(count),
+                .operator => |operator| {
+                    var rhs = support.supPopNumber();
+                    support.supSetNumber(operator(support.supNumber(support.runtime.top), rhs));
+                },
+                .call => |count| support.supCall(count),
+                .tail_call => |count| {
+                    if (count == lambda.arity and support.supType(support.runtime.top) == &self.types[id]) {
+                        args = support.supArgs(count);
+                        pc = lambda.code_start;
+                        continue;
+                    }
+                    support.supTailCall(count);
                     return;
+                },
+                .jump_if_false => |target| if (support.supPopNumber() == 0) {
+                    pc = target;
+                },
+                .jump => |target| pc = target,
+                .ret => return,
+            }
+        }
+    }
+
+    fn pushClosure(self: *Interpreter, site: ClosureSite, locals: []support.ManagedVariable) void {
+        var lambda_type = &self.types[site.lambda];
+        if (site.captures.len == 0) {
+            support.supPushLambda(lambda_type);
+            return;
+        }
+        support.supPushClosure(lambda_type, site.captures.len);
+        for (site.captures, 0..) |capture, index| {
+            var value = if (capture.env) support.supEnv(locals[0]).*.vars()[capture.index] else locals[capture.index];
+            support.supEnv(support.runtime.top).*.vars()[index] = value;
+        }
+    }
+};
+
+/// Turns the RPN of one lambda into Ops, see Interpreter.load.
+const LambdaDecoder = struct {
+    interpreter: *Interpreter,
+    allocator: std.mem.Allocator,
+    symbols: *const SymbolTable,
+    rpn: []RPN,
+    /// The id of the lambda starting at each RPN index.
+    ids: []u32,
+    /// The first Op decoded from each RPN index, jumps land there.
+    code_index: []u32,
+    slots: std.AutoHashMap(usize, u32),
+    free: std.ArrayList(usize),
+    /// Ops whose target is still an RPN index.
+    jumps: std.ArrayList(usize),
+
+    fn emit(self: *LambdaDecoder, op: Op) !void {
+        try self.interpreter.code.append(op);
+    }
+
+    /// Emits the Op for reaching the binding made by `bind` from the
+    /// lambda being decoded.
+    fn access(self: *LambdaDecoder, bind: usize, comptime local: []const u8, comptime env: []const u8) !void {
+        var boxed = self.rpn[bind] == .bind_boxed;
+        if (self.slots.get(bind)) |slot| {
+            try self.emit(if (boxed) @unionInit(Op, local ++ "_boxed", slot) else @unionInit(Op, local, slot));
+        } else {
+            var index: u32 = @intCast(std.mem.indexOfScalar(usize, self.free.items, bind).?);
+            try self.emit(if (boxed) @unionInit(Op, env ++ "_boxed", index) else @unionInit(Op, env, index));
+        }
+    }
+
+    fn capture(self: *LambdaDecoder, bind: usize) Capture {
+        if (self.slots.get(bind)) |slot| {
+            return Capture{ .env = false, .index = slot };
+        }
+        return Capture{ .env = true, .index = @intCast(std.mem.indexOfScalar(usize, self.free.items, bind).?) };
+    }
+
+    fn builtinType(symbol: u32) *support.ManagedType {
+        var index = symbol - first_builtin_symbol;
+        inline for (builtins, 0..) |b, i| {
+            if (i == index) {
+                return &@field(support, b.c_name);
+            }
+        }
+        unreachable;
+    }
+
+    fn decode(self: *LambdaDecoder, start: usize) !InterpretedLambda {
+        var rpn = self.rpn;
+        var end = rpn[start].lambda.end;
+        try lambdaFreeVariables(rpn, start, &self.free);
+        var next_slot: u32 = @intFromBool(self.free.items.len > 0);
+        self.slots.clearRetainingCapacity();
+        self.jumps.clearRetainingCapacity();
+        var code_start: u32 = @intCast(self.interpreter.code.items.len);
+        var arity = rpn[start].lambda.arity;
+        var param: u32 = arity;
+
+        var i = start + 1;
+        while (i < end) : (i += 1) {
+            self.code_index[i] = @intCast(self.interpreter.code.items.len);
+            switch (rpn[i]) {
+                .lambda => |nested| {
+                    var nested_free = std.ArrayList(usize).init(self.allocator);
+                    try lambdaFreeVariables(rpn, i, &nested_free);
+                    var captures = try self.allocator.alloc(Capture, nested_free.items.len);
+                    for (nested_free.items, captures) |bind, *c| {
+                        c.* = self.capture(bind);
+                    }
+                    try self.interpreter.closures.append(ClosureSite{ .lambda = self.ids[i], .captures = captures });
+                    try self.emit(Op{ .push_closure = @intCast(self.interpreter.closures.items.len - 1) });
+                    i = nested.end;
+                },
+                .lambda_context_load => {
+                    if (self.free.items.len > 0) {
+                        try self.emit(.load_env);
+                    }
+                    param = 0;
+                    if (arity == 0) {
+                        try self.emit(Op{ .drop_call = 0 });
+                    }
+                },
+                .bind, .bind_captured, .bind_boxed => {
+                    try self.slots.put(i, next_slot);
+                    if (param < arity) {
+                        var bind = ArgBind{ .slot = next_slot, .arg = param };
+                        try self.emit(if (rpn[i] == .bind_boxed) Op{ .bind_arg_boxed = bind } else Op{ .bind_arg = bind });
+                        param += 1;
+                        if (param == arity) {
+                            try self.emit(Op{ .drop_call = arity });
+                        }
+                    } else {
+                        try self.emit(if (rpn[i] == .bind_boxed) Op{ .bind_boxed = next_slot } else Op{ .set_local = next_slot });
+                    }
+                    next_slot += 1;
+                },
+                .get_by_bind => |bind| try self.access(bind, "push_local", "push_env"),
+                .set_by_bind => |bind| try self.access(bind, "set_local", "set_env"),
+                .get => |symbol| {
+                    var b = builtinOf(symbol) orelse std.debug.panic("unknown primitive: {s}", .{self.symbols.nameOf(symbol)});
+                    var next = rpnNext(rpn, i);
+                    if (!(rpn[next] == .call and rpn[next].call == 2 and b.fold != null)) {
+                        try self.emit(Op{ .push_builtin = builtinType(symbol) });
+                    }
+                },
+                .call, .call_known => {
+                    var callee = rpn[rpnPrevious(rpn, i)];
+                    if (rpn[i] == .call and rpn[i].call == 2 and callee == .get and builtinOf(callee.get).?.fold != null) {
+                        try self.emit(Op{ .operator = builtinOf(callee.get).?.fold.? });
+                    } else if (isTailCall(rpn, i)) {
+                        try self.emit(Op{ .tail_call = @intCast(rpn[i].call) });
+                    } else {
+                        try self.emit(Op{ .call = switch (rpn[i]) {
+                            .call => |count| @intCast(count),
+                            .call_known => |value| rpn[value].lambda.arity,
+                            else => unreachable,
+                        } });
+                    }
+                },
+                .push_number => |n| try self.emit(Op{ .push_number = n }),
+                .str => |symbol| {
+                    var text = try unescapeString(self.allocator, self.symbols.nameOf(symbol));
+                    // The same layout as struct String.
+                    var literal = try self.allocator.alignedAlloc(u8, 8, 16 + text.len + 1);
+                    @as(*[2]usize, @ptrCast(literal.ptr)).* = .{ @intFromPtr(&support.type_literal_string), text.len };
+                    @memcpy(literal[16 .. 16 + text.len], text);
+                    literal[16 + text.len] = 0;
+                    try self.emit(Op{ .push_literal = literal.ptr });
+                },
+                .condition_start => |condition_else| {
+                    try self.jumps.append(self.interpreter.code.items.len);
+                    try self.emit(Op{ .jump_if_false = @intCast(condition_else + 1) });
+                },
+                .condition_else => |condition_end| {
+                    try self.jumps.append(self.interpreter.code.items.len);
+                    try self.emit(Op{ .jump = @intCast(condition_end) });
+                },
+                .condition_end, .scope_begin, .scope_end, .placeholder => {},
+                .lambda_ret, .set => unreachable,
+            }
+        }
+        self.code_index[end] = @intCast(self.interpreter.code.items.len);
+        try self.emit(.ret);
+
+        for (self.jumps.items) |at| {
+            var op = &self.interpreter.code.items[at];
+            switch (op.*) {
+                .jump_if_false => |*target| target.* = self.code_index[target.*],
+                .jump => |*target| target.* = self.code_index[target.*],
+                else => unreachable,
+            }
+        }
+        return InterpretedLambda{ .code_start = code_start, .local_count = next_slot, .arity = arity };
+    }
+};
+
+/// Tells whether `text` holds complete forms, so the REPL knows when to
+/// stop reading lines.
+fn formIsComplete(text: []const u8) bool {
+    var depth: isize = 0;
+    var i: usize = 0;
+    while (i < text.len) : (i += 1) {
+        switch (text[i]) {
+            '(' => depth += 1,
+            ')' => depth -= 1,
+            ';' => i = std.mem.indexOfScalarPos(u8, text, i, '\n') orelse break,
+            '"' => {
+                i += 1;
+                while (i < text.len and text[i] != '"') : (i += 1) {
+                    if (text[i] == '\\') {
+                        i += 1;
+                    }
                 }
-                depth -= 1;
-            },
-            else => {
-                if (depth == 1) {
-                    try codegenInstructionC(rpn, i, writer);
+                if (i >= text.len) {
+                    return false;
                 }
-            }
+            },
+            else => {},
         }
     }
+    return depth <= 0;
 }
 
-pub fn main() !void {
-    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
-    const allocator = gpa.allocator();
-    var tokenizer = Tokenizer{
-        .index = 0,
-        .state = .normal,
-        .tokens = Tokens{},
-        .allocator = allocator,
-        .source = std.ArrayList(u8).init(allocator),
-    };
+fn printValue(writer: anytype, value: support.ManagedVariable) !void {
+    if (support.supIsNumber(value)) {
+        try writer.print("{d}\n", .{support.supNumber(value)});
+    } else if (support.supIsString(value)) {
+        var string = support.supString(value);
+        try writer.print("{s}\n", .{string.*.bytes()[0..string.*.len]});
+    } else {
+        try writer.writeAll("<lambda>\n");
+    }
+}
 
-    var reader = std.io.getStdIn().reader();
-    var buf: [1024]u8 = undefined;
-    while (reader.read(&buf)) |count| {
-        if (count == 0) {
-            break;
-        }
-        tokenizer.feed(buf[0..count]) catch |err| {
-            if (err == TokenizerError.unexpected_char) {
-                var index = tokenizer.index;
-                var items = tokenizer.source.items;
-                var loc = std.zig.findLineColumn(items, index);
-                std.debug.print(
-                    \\char: "{c}" at location {d}:{d}
-                    \\line: {s}\n
-                , .{
-                    items[index],
-                    loc.line + 1,
-                    loc.column + 1,
-                    loc.source_line,
-                });
-            } else {
-                std.debug.print("{any}\n", .{err});
+/// Reads expressions from stdin and prints what they evaluate to. Each one
+/// is the body of a lambda taking the argument count as N.
+fn repl(allocator: std.mem.Allocator, compiler: *Compiler, interpreter: *Interpreter, form_arena: *std.heap.ArenaAllocator, form_allocator: std.mem.Allocator) !void {
+    var stdin = std.io.bufferedReader(std.io.getStdIn().reader());
+    var stdout = std.io.getStdOut().writer();
+    var input = std.ArrayList(u8).init(allocator);
+    while (true) {
+        try stdout.writeAll(if (input.items.len == 0) "> " else ". ");
+        var line = (try stdin.reader().readUntilDelimiterOrEofAlloc(allocator, '\n', std.math.maxInt(u32))) orelse break;
+        try input.appendSlice(line);
+        try input.append('\n');
+        if (!formIsComplete(input.items)) {
+            continue;
+        }
+        if (std.mem.trim(u8, input.items, " \t\r\n").len == 0) {
+            input.clearRetainingCapacity();
+            continue;
+        }
+        // The symbol table refers to the source, so every entry is kept.
+        var source = try std.fmt.allocPrint(allocator, "(lambda (N) {s})", .{input.items});
+        input.clearRetainingCapacity();
+        compiler.tokenizer.source = source;
+        compiler.tokenizer.index = 0;
+
+        _ = form_arena.reset(.retain_capacity);
+        var rpn = compiler.nextFormRPN(form_allocator) catch |err| {
+            reportError(source, compiler.tokenizer.index, err);
+            switch (err) {
+                TokenizerError.unexpected_char, TokenizerError.unterminated_string => continue,
+                else => return err,
             }
-        };
-    } else |err| {
-        return err;
+        } orelse continue;
+        try interpreter.load(form_allocator, &compiler.tokenizer.symbols, rpn);
+        interpreter.runRoot(support.program_args_count);
+        support.supFlushOutput();
+        try printValue(stdout, support.runtime.top);
+        support.supStackDrop();
     }
+}
 
-    var slice = tokenizer.tokens.slice();
-    for (slice.items(.tag), slice.items(.index)) |tag, index| {
-        std.debug.print("// {any} at {d}\n", .{ tag, index });
+fn reportError(source: []const u8, index: usize, err: anyerror) void {
+    switch (err) {
+        TokenizerError.unexpected_char, TokenizerError.unterminated_string => {
+            var loc = std.zig.findLineColumn(source, index);
+            std.debug.print(
+                \\{s}: "{c}" at location {d}:{d}
+                \\line: {s}\n
+            , .{
+                @errorName(err),
+                source[index],
+                loc.line + 1,
+                loc.column + 1,
+                loc.source_line,
+            });
+        },
+        else => {},
+    }
+}
+
+pub fn main() !void {
+    // Everything the compiler allocates lives until it exits, or until the
+    // form it belongs to has been compiled.
+    var stats = PhaseStats{};
+    var program_arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer program_arena.deinit();
+    var program_counter = CountingAllocator{ .child = program_arena.allocator(), .stats = &stats };
+    const allocator = program_counter.allocator();
+    var form_arena = std.heap.ArenaAllocator.init(std.heap.page_allocator);
+    defer form_arena.deinit();
+    var form_counter = CountingAllocator{ .child = form_arena.allocator(), .stats = &stats };
+
+    var print_stats = false;
+    var dump = DumpOptions{};
+    var mode: enum { compile, run, repl } = .compile;
+    var jit = false;
+    var profile = false;
+    var path: ?[]const u8 = null;
+    var output: ?[]const u8 = null;
+    // Passed on to programs run by the interpreter, after the path.
+    var program_args = std.ArrayList([*c]const u8).init(allocator);
+    var args = try std.process.argsAlloc(allocator);
+    var arg_index: usize = 1;
+    while (arg_index < args.len) : (arg_index += 1) {
+        var arg = args[arg_index];
+        if (std.mem.eql(u8, arg, "-o") and arg_index + 1 < args.len) {
+            arg_index += 1;
+            output = args[arg_index];
+        } else if (std.mem.eql(u8, arg, "--stats")) {
+            print_stats = true;
+        } else if (std.mem.eql(u8, arg, "--dump-tokens")) {
+            dump.tokens = true;
+        } else if (std.mem.eql(u8, arg, "--dump-ast")) {
+            dump.ast = true;
+        } else if (std.mem.eql(u8, arg, "--dump-rpn")) {
+            dump.rpn = true;
+        } else if (std.mem.eql(u8, arg, "--run")) {
+            mode = .run;
+        } else if (std.mem.eql(u8, arg, "--repl")) {
+            mode = .repl;
+        } else if (std.mem.eql(u8, arg, "--jit")) {
+            jit = true;
+        } else if (std.mem.eql(u8, arg, "--profile")) {
+            profile = true;
+        } else if (path == null) {
+            path = arg;
+            try program_args.append(arg.ptr);
+        } else {
+            try program_args.append(arg.ptr);
+        }
+    }
+    var source = if (mode == .repl)
+        ""
+    else if (path) |p|
+        try readSourceFile(allocator, p)
+    else
+        try std.io.getStdIn().readToEndAlloc(allocator, std.math.maxInt(u32));
+
+    // With -o the C goes to the driver, otherwise to stdout.
+    var driver: ?Driver = null;
+    var c_file = std.io.getStdOut();
+    if (output != null) {
+        driver = try Driver.init(allocator);
+        c_file = try driver.?.createSource();
+    }
+    var stdout = std.io.BufferedWriter(1 << 16, std.fs.File.Writer){ .unbuffered_writer = c_file.writer() };
+    var stderr = std.io.BufferedWriter(1 << 16, std.fs.File.Writer){ .unbuffered_writer = std.io.getStdErr().writer() };
+    defer stderr.flush() catch {};
+    var compiler = try Compiler.init(allocator, source, stdout.writer(), &stats);
+    compiler.dump = dump;
+    compiler.dump_writer = stderr.writer();
+    compiler.profile = profile;
+    if (path) |p| {
+        compiler.path = p;
+    }
+    if (driver) |*d| {
+        compiler.cache = d.cache;
+        compiler.c_path = "program.c";
+    }
+
+    if (mode != .compile) {
+        if (program_args.items.len == 0) {
+            try program_args.append("repl");
+        }
+        support.program_args = program_args.items.ptr;
+        support.program_args_count = @intCast(program_args.items.len);
+        var interpreter = try Interpreter.init(allocator);
+        var jit_driver: Driver = undefined;
+        if (jit) {
+            jit_driver = try Driver.init(allocator);
+            interpreter.driver = &jit_driver;
+        }
+        if (mode == .repl) {
+            return repl(allocator, &compiler, &interpreter, &form_arena, form_counter.allocator());
+        }
+        var result: i64 = 0;
+        while (true) {
+            _ = form_arena.reset(.retain_capacity);
+            var rpn = compiler.nextFormRPN(form_counter.allocator()) catch |err| {
+                reportError(source, compiler.tokenizer.index, err);
+                return err;
+            } orelse break;
+            try interpreter.load(form_counter.allocator(), &compiler.tokenizer.symbols, rpn);
+            interpreter.runRoot(support.program_args_count);
+            result = support.supNumber(support.runtime.top);
+            support.supStackDrop();
+        }
+        support.supFlushOutput();
+        if (print_stats) {
+            try stats.print(stderr.writer());
+        }
+        stderr.flush() catch {};
+        std.process.exit(@truncate(@as(u64, @bitCast(result))));
     }
 
-    var parser = Parser{
-        .index = 0,
-        .nodes = std.ArrayList(ASTNode).init(allocator),
+    // Workers free the closure of their job after it ran, even after the
+    // wait for the form is over, so an arena for them could never be
+    // reset between forms. libc frees them as they go.
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = std.heap.c_allocator });
+    defer pool.deinit();
+    compiler.pool = &pool;
+
+    compiler.compileProgram(&form_arena, form_counter.allocator()) catch |err| {
+        reportError(source, compiler.tokenizer.index, err);
+        return err;
     };
+    try stdout.flush();
+    if (driver) |*d| {
+        c_file.close();
+        try d.build(output.?);
+    }
+    if (print_stats) {
+        try stats.print(stderr.writer());
+    }
+}
 
+fn testRPN(allocator: std.mem.Allocator, text: []const u8) ![]RPN {
+    var tokenizer = try Tokenizer.init(allocator);
+    try tokenizer.tokenize(text);
+    var slice = tokenizer.tokens.slice();
+    var parser = Parser.init(allocator);
     var start = try parser.parseExpr(&slice);
-    std.debug.print("// ", .{});
-    parser.prettyPrint(start, false);
-
-    var lambdas = std.ArrayList(usize).init(allocator);
-    var rpnConverter = RPNConverter {
-        .source = tokenizer.source.items,
+    var converter = RPNConverter{
+        .symbols = &tokenizer.symbols,
         .rpn = std.ArrayList(RPN).init(allocator),
         .parser = &parser,
+        .sources = std.ArrayList(u32).init(allocator),
+        .source = 0,
     };
-    try rpnConverter.exprToRPN(start);
-    rpnDetectCaptured(rpnConverter.rpn.items);
-    rpnFixGetCaptures(rpnConverter.rpn.items);
-    rpnFixSetCaptures(rpnConverter.rpn.items);
-    rpnConvertGetToGetBySteps(rpnConverter.rpn.items);
-    rpnConvertSetToSetBySteps(rpnConverter.rpn.items);
-    try rpnFindLambdas(rpnConverter.rpn.items, &lambdas);
-
-
-    std.debug.print("\n// RPN: {any}\n", .{rpnConverter.rpn.items});
-
-
-    var output = std.ArrayList(u8).init(allocator);
-    var writer = output.writer();
-    try writer.print("#include \"support.h\"\n", .{});
-    var i = lambdas.items.len;
-    while(i > 0) {
-        i -= 1;
-        var lambda_start = lambdas.items[i];
-        try codegenC(rpnConverter.rpn.items, lambda_start, &writer);
-    }
-    try writer.print(
-        \\int main(int argc, const char **args) {{
-        \\    program_args = args;
-        \\    program_args_count = argc;
-        \\    supPushNumber(argc);
-        \\    supPushLambda(&lambda_type_0);
-        \\    supCall();
-        \\    return top.v.number;
-        \\}}
-    , .{});
-    std.debug.print("// output:\n", .{});
-
-    const stdout_file = std.io.getStdOut().writer();
-    var bw = std.io.bufferedWriter(stdout_file);
-    const stdout = bw.writer();
-    try stdout.print("{s}\n", .{output.items});
-    try bw.flush();
+    try converter.exprToRPN(start);
+    var resolver = try Resolver.init(allocator, &tokenizer.symbols);
+    try resolver.resolve(converter.rpn.items);
+    return converter.rpn.items;
+}
+
+fn testCountTag(rpn: []RPN, tag: RPNTag) usize {
+    var count: usize = 0;
+    for (rpn) |instruction| {
+        if (instruction == tag) {
+            count += 1;
+        }
+    }
+    return count;
+}
+
+test "tokenizer interns symbols" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var tokenizer = try Tokenizer.init(arena.allocator());
+    try tokenizer.tokenize("(lambda (xs) (+ xs xs))");
+    var symbols = tokenizer.tokens.items(.symbol);
+    var lengths = tokenizer.tokens.items(.len);
+    try std.testing.expectEqual(symbol_lambda, symbols[1]);
+    try std.testing.expectEqual(first_builtin_symbol, symbols[6]);
+    try std.testing.expectEqual(symbols[3], symbols[7]);
+    try std.testing.expectEqual(symbols[3], symbols[8]);
+    try std.testing.expectEqual(@as(u32, 2), lengths[3]);
+    try std.testing.expectEqualStrings("+", builtinOf(symbols[6]).?.name);
+}
+
+test "tokenizer runs longer than a chunk" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var tokenizer = try Tokenizer.init(arena.allocator());
+    try tokenizer.tokenize(
+        \\; a comment that is longer than sixteen bytes
+        \\(a-rather-long-symbol-name "str\"ing" x)
+    );
+    try std.testing.expectEqual(@as(usize, 5), tokenizer.tokens.len);
+    try std.testing.expectEqual(@as(u32, 25), tokenizer.tokens.items(.len)[1]);
+    try std.testing.expectEqual(@as(u32, 10), tokenizer.tokens.items(.len)[2]);
+    try std.testing.expectEqual(@as(u32, 1), tokenizer.tokens.items(.len)[3]);
+}
+
+test "tokenizer splits top-level forms" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var tokenizer = try Tokenizer.init(arena.allocator());
+    tokenizer.source = "(lambda (x) (f x)) ; comment\n(lambda (y) y)\n";
+    try std.testing.expect(try tokenizer.nextForm(arena.allocator()));
+    try std.testing.expectEqual(@as(usize, 10), tokenizer.tokens.len);
+    try std.testing.expect(try tokenizer.nextForm(arena.allocator()));
+    try std.testing.expectEqual(@as(usize, 7), tokenizer.tokens.len);
+    try std.testing.expect(!try tokenizer.nextForm(arena.allocator()));
+}
+
+test "resolve boxes recursive let bindings" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var rpn = try testRPN(arena.allocator(), "(lambda (N) (let (f (lambda (n) (f n))) (f N)))");
+    try std.testing.expectEqual(@as(usize, 1), testCountTag(rpn, .bind_boxed));
+    try std.testing.expectEqual(@as(usize, 2), testCountTag(rpn, .bind));
+    try std.testing.expectEqual(@as(usize, 0), testCountTag(rpn, .get));
+}
+
+test "resolve shadowed bindings" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var rpn = try testRPN(arena.allocator(), "(lambda (x) ((lambda (x) (+ x 1)) x))");
+    try std.testing.expectEqual(@as(usize, 0), testCountTag(rpn, .bind_captured));
+    for (rpn) |instruction| {
+        switch (instruction) {
+            // Both gets refer to the closest binding of `x`.
+            .get_by_bind => |bind| try std.testing.expect(rpn[bind] == .bind),
+            else => {},
+        }
+    }
+}
+
+test "resolve large input" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    const allocator = arena.allocator();
+    var source = std.ArrayList(u8).init(allocator);
+    const depth = 2000;
+    try source.appendSlice("(lambda (x) ");
+    for (0..depth) |_| {
+        try source.appendSlice("(+ x ");
+    }
+    try source.appendSlice("1");
+    for (0..depth) |_| {
+        try source.appendSlice(")");
+    }
+    try source.appendSlice(")");
+    var rpn = try testRPN(allocator, source.items);
+    try std.testing.expectEqual(@as(usize, depth), testCountTag(rpn, .get_by_bind));
+}
+
+test "let with several bindings" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var rpn = try testRPN(arena.allocator(), "(lambda (N) (let (a 1 b (+ a 2) c (+ a b)) (+ c N)))");
+    try std.testing.expectEqual(@as(usize, 4), testCountTag(rpn, .bind));
+    try std.testing.expectEqual(@as(usize, 3), testCountTag(rpn, .set_by_bind));
+    try std.testing.expectEqual(@as(usize, 5), testCountTag(rpn, .get_by_bind));
+}
+
+test "lists keep their children next to each other" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var tokenizer = try Tokenizer.init(arena.allocator());
+    try tokenizer.tokenize("(a (b c) d)");
+    var slice = tokenizer.tokens.slice();
+    var parser = Parser.init(arena.allocator());
+    var root = try parser.parseExpr(&slice);
+    var list = parser.nodes.items(.data)[root].list;
+    try std.testing.expectEqual(@as(u32, 3), list.count);
+    try std.testing.expectEqual(ASTTag.list, parser.nodes.items(.tag)[list.first_child + 1]);
+    try std.testing.expectEqual(@as(usize, 6), parser.nodes.len);
+}
+
+test "fold constants" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var rpn = try testRPN(arena.allocator(), "(lambda (N) (if (< 1 (- 3 1)) (+ N (+ 1 2)) (put-str N)))");
+    foldConstants(rpn);
+    try std.testing.expectEqual(@as(usize, 0), testCountTag(rpn, .condition_start));
+    try std.testing.expectEqual(@as(usize, 0), testCountTag(rpn, .condition_end));
+    try std.testing.expectEqual(@as(usize, 1), testCountTag(rpn, .get));
+    try std.testing.expectEqual(@as(usize, 1), testCountTag(rpn, .call));
+    for (rpn) |instruction| {
+        switch (instruction) {
+            .push_number => |n| try std.testing.expectEqual(@as(i64, 3), n),
+            else => {},
+        }
+    }
+}
+
+test "calls of let bound lambdas are known" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var rpn = try testRPN(arena.allocator(), "(lambda (N) (let (fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (+ (fib N) 1)))");
+    try resolveKnownCallees(arena.allocator(), rpn);
+    try std.testing.expectEqual(@as(usize, 3), testCountTag(rpn, .call_known));
+    for (rpn) |instruction| {
+        switch (instruction) {
+            .call_known => |callee| try std.testing.expect(rpn[callee] == .lambda),
+            else => {},
+        }
+    }
+}
+
+test "lambdas on numbers alone are integer lambdas" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var rpn = try testRPN(arena.allocator(),
+        \\(lambda (N) (let (fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))
+        \\                  show (lambda (n) (num-to-str (fib n)))
+        \\                  sum (lambda (i total) (if (= i 0) total (sum (- i 1) (+ total i))))
+        \\                  parse (lambda (s) (fib (str-to-num s))))
+        \\    (show (sum (parse "9") 0))))
+    );
+    try resolveKnownCallees(arena.allocator(), rpn);
+    var lambdas = try inferIntegerLambdas(arena.allocator(), rpn);
+    var starts = std.ArrayList(usize).init(arena.allocator());
+    try rpnFindLambdas(rpn, &starts);
+    var integer = std.ArrayList(bool).init(arena.allocator());
+    for (starts.items) |start| {
+        try integer.append(lambdas.integer[start]);
+    }
+    try std.testing.expectEqualSlices(bool, &.{ false, true, false, true, false }, integer.items);
+}
+
+test "lambdas applied where they are made are inlined" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    const text = "(lambda (N) (let (x 10) ((lambda (a b) (- a (+ b x))) 332 N)))";
+    var stats = PhaseStats{};
+    var compiler = try Compiler.init(arena.allocator(), text, undefined, &stats);
+    var rpn = (try compiler.nextFormRPN(arena.allocator())).?;
+    try std.testing.expectEqual(@as(usize, 1), testCountTag(rpn, .lambda));
+    try std.testing.expectEqual(@as(usize, 0), testCountTag(rpn, .bind_captured));
+    try std.testing.expectEqual(@as(i64, 321), support.supNumber(try testInterpret(arena.allocator(), text)));
+}
+
+/// Compiles `text` to C with the form cache in `dir` and returns the C.
+fn testCompile(allocator: std.mem.Allocator, dir: std.fs.Dir, text: []const u8, stats: *PhaseStats, pool: ?*std.Thread.Pool) ![]const u8 {
+    var form_arena = std.heap.ArenaAllocator.init(allocator);
+    defer form_arena.deinit();
+    var form_counter = CountingAllocator{ .child = form_arena.allocator(), .stats = stats };
+    var c_file = try dir.createFile("test.c", .{});
+    var c_writer = std.io.BufferedWriter(1 << 16, std.fs.File.Writer){ .unbuffered_writer = c_file.writer() };
+    var compiler = try Compiler.init(allocator, text, c_writer.writer(), stats);
+    compiler.cache = dir;
+    compiler.pool = pool;
+    compiler.c_path = "test.c";
+    try compiler.compileProgram(&form_arena, form_counter.allocator());
+    try c_writer.flush();
+    c_file.close();
+    return dir.readFileAlloc(allocator, "test.c", std.math.maxInt(u32));
+}
+
+test "unchanged forms are reused from the cache" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const text = "(lambda (N) (let (f (lambda (x) (str-cat \"x\" (num-to-str x)))) (f N)))\n";
+    var first_stats = PhaseStats{};
+    var first = try testCompile(arena.allocator(), tmp.dir, text, &first_stats, null);
+    try std.testing.expect(first_stats.bytes.get(.parse) > 0);
+
+    var stats = PhaseStats{};
+    try std.testing.expectEqualStrings(first, try testCompile(arena.allocator(), tmp.dir, text, &stats, null));
+    try std.testing.expectEqual(@as(usize, 0), stats.bytes.get(.parse));
+
+    // The form moved a line down, so did its #line directives.
+    stats = PhaseStats{};
+    var moved = try testCompile(arena.allocator(), tmp.dir, "\n" ++ text, &stats, null);
+    try std.testing.expectEqual(@as(usize, 0), stats.bytes.get(.parse));
+    try std.testing.expect(std.mem.indexOf(u8, moved, "#line 2 \"<stdin>\"") != null);
+    try std.testing.expect(std.mem.indexOf(u8, moved, "#line 1 \"<stdin>\"") == null);
+
+    // Lines within the form move only some of them, that is a miss.
+    stats = PhaseStats{};
+    var split = try testCompile(arena.allocator(), tmp.dir, "(lambda (N)\n" ++ text["(lambda (N) ".len..], &stats, null);
+    try std.testing.expect(stats.bytes.get(.parse) > 0);
+    try std.testing.expect(std.mem.indexOf(u8, split, "#line 2 \"<stdin>\"") != null);
+}
+
+test "forms after a changed one are reused from the cache" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var allocator = arena.allocator();
+    var tmp = std.testing.tmpIterableDir(.{});
+    defer tmp.cleanup();
+    // On the line of the first form, so the #line of the second stay put.
+    const second = "(lambda (N) (let (g (lambda (x) (str-cat \"b\" x))) (g \"\")))\n";
+    var stats = PhaseStats{};
+    var first = try testCompile(allocator, tmp.iterable_dir.dir, "(lambda (N) 1) " ++ second, &stats, null);
+
+    // Marks the C of the second form, which names its lambda g.
+    var fragment: ?[]const u8 = null;
+    var entries = tmp.iterable_dir.iterate();
+    while (try entries.next()) |entry| {
+        if (!std.mem.startsWith(u8, entry.name, "form-")) {
+            continue;
+        }
+        var cached = try tmp.iterable_dir.dir.readFileAlloc(allocator, entry.name, std.math.maxInt(u32));
+        if (std.mem.indexOf(u8, cached, "lol_g_") != null) {
+            fragment = cached[std.mem.indexOfScalar(u8, cached, '\n').? + 1 ..];
+            var file = try tmp.iterable_dir.dir.openFile(entry.name, .{ .mode = .write_only });
+            defer file.close();
+            try file.seekFromEnd(0);
+            try file.writeAll("// reused\n");
+        }
+    }
+    try std.testing.expect(std.mem.indexOf(u8, first, fragment.?) != null);
+
+    stats = PhaseStats{};
+    var changed = try testCompile(allocator, tmp.iterable_dir.dir, "(lambda (N) 2) " ++ second, &stats, null);
+    try std.testing.expect(stats.bytes.get(.parse) > 0);
+    try std.testing.expect(std.mem.indexOf(u8, changed, try std.mem.concat(allocator, u8, &.{ fragment.?, "// reused\n" })) != null);
+}
+
+test "lines after the lambdas of a form are those of the C file" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    var stats = PhaseStats{};
+    // The string of the second form is emitted after the lambdas of the first.
+    var c = try testCompile(arena.allocator(), tmp.dir, "(lambda (N) N)\n(lambda (N) \"s\")\n", &stats, null);
+    var lines = std.mem.splitScalar(u8, c, '\n');
+    var line: u32 = 0;
+    var resets: usize = 0;
+    while (lines.next()) |text| {
+        line += 1;
+        if (std.mem.endsWith(u8, text, " \"test.c\"")) {
+            try std.testing.expectEqualStrings(try std.fmt.allocPrint(arena.allocator(), "#line {d} \"test.c\"", .{line + 1}), text);
+            resets += 1;
+        }
+    }
+    try std.testing.expectEqual(@as(usize, 2), resets);
+}
+
+test "lambdas generated in parallel are the same" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var allocator = arena.allocator();
+    // Both compile every form, they do not share a cache.
+    var serial_tmp = std.testing.tmpDir(.{});
+    defer serial_tmp.cleanup();
+    var parallel_tmp = std.testing.tmpDir(.{});
+    defer parallel_tmp.cleanup();
+    var source = std.ArrayList(u8).init(allocator);
+    try source.appendSlice("(lambda (N) (let (f0 (lambda (x) x)\n");
+    for (1..100) |i| {
+        try source.writer().print("    f{d} (lambda (x) (str-cat \"{d}\" (f{d} x)))\n", .{ i, i, i - 1 });
+    }
+    try source.appendSlice(") (f99 \"\")))\n");
+
+    var pool: std.Thread.Pool = undefined;
+    try pool.init(.{ .allocator = std.testing.allocator });
+    defer pool.deinit();
+    var stats = PhaseStats{};
+    var serial = try testCompile(allocator, serial_tmp.dir, source.items, &stats, null);
+    var parallel = try testCompile(allocator, parallel_tmp.dir, source.items, &stats, &pool);
+    try std.testing.expectEqualStrings(serial, parallel);
+}
+
+fn testInterpret(allocator: std.mem.Allocator, text: []const u8) !support.ManagedVariable {
+    var stats = PhaseStats{};
+    var compiler = try Compiler.init(allocator, text, undefined, &stats);
+    var rpn = (try compiler.nextFormRPN(allocator)).?;
+    var interpreter = try Interpreter.init(allocator);
+    try interpreter.load(allocator, &compiler.tokenizer.symbols, rpn);
+    interpreter.runRoot(1);
+    var result = support.runtime.top;
+    support.supStackDrop();
+    return result;
+}
+
+/// Whether there is a C compiler for the tests that build generated C.
+fn testHaveCC(allocator: std.mem.Allocator) bool {
+    var result = std.ChildProcess.exec(.{ .allocator = allocator, .argv = &.{ "cc", "--version" } }) catch return false;
+    return result.term == .Exited and result.term.Exited == 0;
+}
+
+test "hot lambdas are compiled while interpreting" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var allocator = arena.allocator();
+    if (!testHaveCC(allocator)) {
+        return error.SkipZigTest;
+    }
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    var driver = Driver{ .allocator = allocator, .cache = tmp.dir, .cc = "cc" };
+    const text = "(lambda (N) (let (fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib (+ N 14))))";
+    var stats = PhaseStats{};
+    var compiler = try Compiler.init(allocator, text, undefined, &stats);
+    var rpn = (try compiler.nextFormRPN(allocator)).?;
+    var interpreter = try Interpreter.init(allocator);
+    interpreter.driver = &driver;
+    interpreter.jit_threshold = 1;
+    try interpreter.load(allocator, &compiler.tokenizer.symbols, rpn);
+    interpreter.runRoot(1);
+    var result = support.runtime.top;
+    support.supStackDrop();
+    try std.testing.expectEqual(@as(i64, 610), support.supNumber(result));
+    // fib is the second lambda of the form, see Interpreter.load.
+    try std.testing.expect(@intFromPtr(interpreter.types[1].func) != @intFromPtr(&interpretedLambdaEntry));
+}
+
+test "integer lambdas get a C function on i64" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var allocator = arena.allocator();
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const text = "(lambda (N) (let (sum (lambda (i total) (if (= i 0) total (sum (- i 1) (+ total i))))) (sum (+ N 9) 0)))";
+    var stats = PhaseStats{};
+    var c = try testCompile(allocator, tmp.dir, text, &stats, null);
+    var name_start = (std.mem.indexOf(u8, c, "i64 lol_sum_") orelse return error.TestExpectedEqual) + "i64 ".len;
+    var name = c[name_start .. std.mem.indexOfPos(u8, c, name_start, "_int(").? + "_int(".len];
+    try std.testing.expect(std.mem.indexOf(u8, c, try std.fmt.allocPrint(allocator, "{s}i64, i64);\n", .{name})) != null);
+    try std.testing.expect(std.mem.indexOf(u8, c, try std.fmt.allocPrint(allocator, "{s}i64 v", .{name})) != null);
+    // The self tail call jumps back to the top.
+    try std.testing.expect(std.mem.indexOf(u8, c, "entry:;\n") != null);
+    try std.testing.expect(std.mem.indexOf(u8, c, "    goto entry;\n") != null);
+    // The generic entry hands numbers to the integer function.
+    try std.testing.expect(std.mem.indexOf(u8, c, try std.fmt.allocPrint(allocator, "supPushValue(supNumberValue({s}", .{name})) != null);
+
+    if (!testHaveCC(allocator)) {
+        return error.SkipZigTest;
+    }
+    var driver = Driver{ .allocator = allocator, .cache = tmp.dir, .cc = "cc" };
+    try tmp.dir.writeFile("program.c", c);
+    var exe = try std.fs.path.join(allocator, &.{ try tmp.dir.realpathAlloc(allocator, "."), "sum" });
+    try driver.build(exe);
+    var result = try std.ChildProcess.exec(.{ .allocator = allocator, .argv = &.{exe} });
+    try std.testing.expectEqual(std.ChildProcess.Term{ .Exited = 55 }, result.term);
+}
+
+test "known calls pass their arguments as C parameters" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var allocator = arena.allocator();
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    const text = "(lambda (N) (let (f (lambda (x y) (str-cat \"\" (num-to-str (- x y))))) (str-to-num (f (+ N 42) 1))))";
+    var stats = PhaseStats{};
+    var c = try testCompile(allocator, tmp.dir, text, &stats, null);
+    var name_start = (std.mem.indexOf(u8, c, "void lol_f_") orelse return error.TestExpectedEqual) + "void ".len;
+    var name = c[name_start..std.mem.indexOfScalarPos(u8, c, name_start, '(').?];
+    if (std.mem.endsWith(u8, name, "_direct")) {
+        name = name[0 .. name.len - "_direct".len];
+    }
+    try std.testing.expect(std.mem.indexOf(u8, c, try std.fmt.allocPrint(allocator, "void {s}_direct(struct ManagedVariable a0, struct ManagedVariable a1, struct ManagedVariable callee) {{\n", .{name})) != null);
+    // The call site does not push, the entry forwards what is on the stack.
+    try std.testing.expect(std.mem.indexOf(u8, c, try std.fmt.allocPrint(allocator, "    {s}_direct(supNumberValue(", .{name})) != null);
+    try std.testing.expect(std.mem.indexOf(u8, c, try std.fmt.allocPrint(allocator, "    {s}_direct(a0, a1, callee);\n", .{name})) != null);
+    try std.testing.expect(std.mem.indexOf(u8, c, "supCallKnown(") == null);
+
+    if (!testHaveCC(allocator)) {
+        return error.SkipZigTest;
+    }
+    var driver = Driver{ .allocator = allocator, .cache = tmp.dir, .cc = "cc" };
+    try tmp.dir.writeFile("program.c", c);
+    var exe = try std.fs.path.join(allocator, &.{ try tmp.dir.realpathAlloc(allocator, "."), "direct" });
+    try driver.build(exe);
+    var result = try std.ChildProcess.exec(.{ .allocator = allocator, .argv = &.{exe} });
+    try std.testing.expectEqual(std.ChildProcess.Term{ .Exited = 42 }, result.term);
+}
+
+test "closures that are only called keep their environment in locals" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var allocator = arena.allocator();
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    var stats = PhaseStats{};
+    // Passed on as an argument, add keeps its closure on the heap.
+    var returned = try testCompile(allocator, tmp.dir, "(lambda (N) (let (add (lambda (x) (+ x N))) (str-cat add)))", &stats, null);
+    try std.testing.expect(std.mem.indexOf(u8, returned, "supPushClosure(") != null);
+    const text = "(lambda (N) (let (add (lambda (x) (+ x N))) (- (add 2) 1)))";
+    var c = try testCompile(allocator, tmp.dir, text, &stats, null);
+    try std.testing.expect(std.mem.indexOf(u8, c, "supPushClosure(") == null);
+    try std.testing.expect(std.mem.indexOf(u8, c, "struct Closure *env = (struct Closure *)&locals[") != null);
+
+    if (!testHaveCC(allocator)) {
+        return error.SkipZigTest;
+    }
+    var driver = Driver{ .allocator = allocator, .cache = tmp.dir, .cc = "cc" };
+    try tmp.dir.writeFile("program.c", c);
+    var exe = try std.fs.path.join(allocator, &.{ try tmp.dir.realpathAlloc(allocator, "."), "local" });
+    try driver.build(exe);
+    var result = try std.ChildProcess.exec(.{ .allocator = allocator, .argv = &.{exe} });
+    try std.testing.expectEqual(std.ChildProcess.Term{ .Exited = 2 }, result.term);
+}
+
+test "only lambdas that jump to their entry get the label" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    // Every tail call here goes to another lambda or has another arity.
+    const text = "(lambda (N) (let (f (lambda (x) x) g (lambda (x y) (f x)) h (lambda (x) (if x (h x 1) (g x x)))) (h N)))";
+    var stats = PhaseStats{};
+    var c = try testCompile(arena.allocator(), tmp.dir, text, &stats, null);
+    try std.testing.expect(std.mem.indexOf(u8, c, "entry:") == null);
+}
+
+test "interpreter runs recursive lambdas" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var result = try testInterpret(arena.allocator(), "(lambda (N) (let (fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2)))))) (fib (+ N 9))))");
+    try std.testing.expectEqual(@as(i64, 55), support.supNumber(result));
+}
+
+test "interpreter makes tail calls and captures" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var result = try testInterpret(arena.allocator(), "(lambda (N) (let (suffix \"!\\x41\" loop (lambda (n) (if (= n 0) (str-cat suffix (num-to-str N)) (loop (- n 1))))) (loop 100000)))");
+    try std.testing.expect(support.supIsString(result));
+    try std.testing.expectEqualStrings("!A1", support.supString(result).*.bytes()[0..support.supString(result).*.len]);
+}
+
+test "lambdas take their arguments in order" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var result = try testInterpret(arena.allocator(), "(lambda (N) (let (sub (lambda (a b) (- a b))) (- (sub 10 3) ((lambda (a b) (- a b)) 4 N))))");
+    try std.testing.expectEqual(@as(i64, 4), support.supNumber(result));
+    result = try testInterpret(arena.allocator(), "(lambda (N) (let (loop (lambda (i sum) (if (= i 0) sum (loop (- i 1) (+ sum i))))) (loop 100 0)))");
+    try std.testing.expectEqual(@as(i64, 5050), support.supNumber(result));
+}
+
+test "lambdas are named after their binding" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var allocator = arena.allocator();
+    var stats = PhaseStats{};
+    const text = "(lambda (N)\n  (let (fib (lambda (n) n)) (fib N)))";
+    var compiler = try Compiler.init(allocator, text, undefined, &stats);
+    var rpn = (try compiler.nextFormRPN(allocator)).?;
+    var lambdas = std.ArrayList(usize).init(allocator);
+    try rpnFindLambdas(rpn, &lambdas);
+    try std.testing.expectEqualStrings("lambda", lambdaName(rpn, &compiler.tokenizer.symbols, lambdas.items[0]));
+    try std.testing.expectEqualStrings("fib", lambdaName(rpn, &compiler.tokenizer.symbols, lambdas.items[1]));
+    try std.testing.expectEqual(@as(usize, 1), std.zig.findLineColumn(text, compiler.sources[lambdas.items[1]]).line);
+    var lines = try compiler.lineNumbers(allocator, rpn);
+    try std.testing.expectEqual(@as(u32, 1), lines[0]);
+    try std.testing.expectEqual(@as(u32, 2), lines[lambdas.items[1]]);
+    try std.testing.expectEqual(@as(u32, 2), lines[rpn.len - 1]);
+
+    // Parameters are bound right before the body, and so are those of
+    // inlined lambdas.
+    for ([_][]const u8{ "(lambda (x) (lambda (y) y))", "(lambda (N) ((lambda (a) (lambda (y) a)) N))" }) |nested| {
+        var nested_compiler = try Compiler.init(allocator, nested, undefined, &stats);
+        var nested_rpn = (try nested_compiler.nextFormRPN(allocator)).?;
+        lambdas.clearRetainingCapacity();
+        try rpnFindLambdas(nested_rpn, &lambdas);
+        try std.testing.expectEqual(@as(usize, 2), lambdas.items.len);
+        try std.testing.expectEqualStrings("lambda", lambdaName(nested_rpn, &nested_compiler.tokenizer.symbols, lambdas.items[1]));
+    }
+}
+
+test "lambdas know where they end" {
+    var arena = std.heap.ArenaAllocator.init(std.testing.allocator);
+    defer arena.deinit();
+    var rpn = try testRPN(arena.allocator(), "(lambda (x) ((lambda (a b) (+ a b)) x 1))");
+    var lambdas = std.ArrayList(usize).init(arena.allocator());
+    try rpnFindLambdas(rpn, &lambdas);
+    try std.testing.expectEqual(@as(usize, 2), lambdas.items.len);
+    try std.testing.expectEqual(rpn.len - 1, @as(usize, rpn[0].lambda.end));
+    for (lambdas.items) |start| {
+        try std.testing.expectEqual(start, rpn[rpn[start].lambda.end].lambda_ret);
+    }
+    try std.testing.expectEqual(@as(u32, 2), rpn[lambdas.items[1]].lambda.arity);
+    try std.testing.expectEqual(@as(usize, 2), lambdaLocalCount(rpn, lambdas.items[1]));
+    try std.testing.expectEqual(@as(usize, 1), lambdaLocalCount(rpn, 0));
 }
 
 // demonstrates higher-order functions:
 // echo "(lambda (x z) (lambda (y z) (+ x y)))" | zig run src\main.zig
 
 // this works:
-// echo "(lambda (x) (+ x 1))" | zig run src\main.zig | wsl gcc -g3 -I src -xc -
+// echo "(lambda (x) (+ x 1))" | zig run src\main.zig | wsl gcc -g3 -I src -xc - src/support.c
+
+// or let the compiler call cc, with outputs cached in .lol-cache:
+// zig build run -- -o fib examples/fibonacci.lsp
+// the C of each top-level form is cached there too, only changed forms are
+// compiled again
+
+// or skip the C compiler and interpret it, or start a REPL:
+// zig build run -- --run examples/fibonacci.lsp 30
+// zig build run -- --repl
+// with --jit, lambdas that are called often get compiled with cc and loaded
+// with --profile the program prints a flat profile when it exits and writes
+// profile.folded, which flamegraph.pl or speedscope can show
 
 // this also works now:
 // echo "(lambda (x) ((lambda (a b) (+ a b)) x 1))" | zig run src\main.zig
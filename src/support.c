@@ -0,0 +1,610 @@
+#include "support.h"
+#ifdef _WIN32
+#include <windows.h>
+#include <intrin.h>
+#else
+#include <sys/mman.h>
+#include <time.h>
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+const char *crash_message = 0;
+const char **program_args = 0;
+i64 program_args_count = 0;
+const char *profile_path = 0;
+
+void fatalError(const char *message) {
+    crash_message = message;
+#ifndef SUPPORT_IGNORE_FATAL_ERRORS
+    supFlushOutput();
+    if (profile_path) {
+        supProfileWrite(profile_path);
+    }
+    fprintf(stderr, "error: %s\n", message);
+    exit(1);
+#endif
+}
+
+const char *call_number_error = "attempted to invoke a number";
+static void callNumberError(u64 argc, struct ManagedVariable *args) {
+    fatalError(call_number_error);
+}
+struct ManagedType type_number = {
+    "number", callNumberError
+};
+
+const char *call_string_error = "attempted to invoke a string";
+static void callStringError(u64 argc, struct ManagedVariable *args) {
+    fatalError(call_string_error);
+}
+struct ManagedType type_string = {
+    "string", callStringError
+};
+
+struct ManagedType type_literal_string = {
+    "string", callStringError
+};
+
+const char *call_box_error = "attempted to invoke a box";
+static void callBoxError(u64 argc, struct ManagedVariable *args) {
+    fatalError(call_box_error);
+}
+struct ManagedType type_box = {
+    "box", callBoxError
+};
+
+_Thread_local struct Runtime runtime;
+
+/// Reserves the stack of the calling thread. It sits between two guard
+/// pages, so running off either end faults instead of corrupting memory,
+/// and pages are only committed once they are touched. Calling it again
+/// does nothing.
+void supRuntimeInit(void) {
+    if (runtime.stack) {
+        return;
+    }
+    u64 page = 1 << 16;
+    u64 size = SUPPORT_STACK_SIZE * sizeof(struct ManagedVariable);
+    size = (size + page - 1) & ~(page - 1);
+#ifdef _WIN32
+    char *mem = VirtualAlloc(0, size + 2 * page, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    DWORD old;
+    if (!mem || !VirtualProtect(mem, page, PAGE_NOACCESS, &old) ||
+        !VirtualProtect(mem + page + size, page, PAGE_NOACCESS, &old)) {
+        fatalError("could not allocate the stack");
+        return;
+    }
+#else
+    char *mem = mmap(0, size + 2 * page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem == MAP_FAILED || mprotect(mem, page, PROT_NONE) ||
+        mprotect(mem + page + size, page, PROT_NONE)) {
+        fatalError("could not allocate the stack");
+        return;
+    }
+#endif
+    runtime.stack = (struct ManagedVariable *)(mem + page);
+    runtime.stack_index = 0;
+}
+
+void supFlushOutput(void) {
+    if (runtime.output_len > 0) {
+        fwrite(runtime.output, 1, runtime.output_len, stdout);
+        runtime.output_len = 0;
+    }
+    fflush(stdout);
+}
+
+void supWrite(const char *bytes, u64 len) {
+    if (runtime.output_len + len > SUPPORT_OUTPUT_SIZE) {
+        supFlushOutput();
+        if (len > SUPPORT_OUTPUT_SIZE) {
+            fwrite(bytes, 1, len, stdout);
+            return;
+        }
+    }
+    memcpy(runtime.output + runtime.output_len, bytes, len);
+    runtime.output_len += len;
+}
+
+static _Thread_local struct SupProfileNode sup_profile_root;
+static _Thread_local struct SupProfileFrame *sup_profile_frames;
+static _Thread_local struct SupProfileSite *sup_profile_sites;
+
+/// The time stamp counter where there is one, nanoseconds otherwise.
+static inline u64 supProfileTicks(void) {
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+    return __rdtsc();
+#elif defined(_WIN32)
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return counter.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u64)now.tv_sec * 1000000000 + now.tv_nsec;
+#endif
+}
+
+void supProfileEnter(struct SupProfileFrame *frame, struct SupProfileSite *site) {
+    if (site->calls == 0) {
+        site->next = sup_profile_sites;
+        sup_profile_sites = site;
+    }
+    site->calls++;
+    site->active++;
+    struct SupProfileNode *parent = sup_profile_frames ? sup_profile_frames->node : &sup_profile_root;
+    struct SupProfileNode *node = parent;
+    if (parent->site != site) {
+        node = parent->first_child;
+        while (node && node->site != site) {
+            node = node->next_sibling;
+        }
+        if (!node) {
+            node = calloc(1, sizeof(struct SupProfileNode));
+            if (!node) {
+                fatalError("out of memory");
+                return;
+            }
+            node->site = site;
+            node->parent = parent;
+            node->next_sibling = parent->first_child;
+            parent->first_child = node;
+        }
+    }
+    frame->previous = sup_profile_frames;
+    frame->node = node;
+    frame->child_ticks = 0;
+    sup_profile_frames = frame;
+    // Last, so the bookkeeping above is not counted.
+    frame->start = supProfileTicks();
+}
+
+void supProfileExit(struct SupProfileFrame *frame) {
+    u64 elapsed = supProfileTicks() - frame->start;
+    struct SupProfileSite *site = frame->node->site;
+    frame->node->self_ticks += elapsed - frame->child_ticks;
+    site->self_ticks += elapsed - frame->child_ticks;
+    site->active--;
+    if (site->active == 0) {
+        site->total_ticks += elapsed;
+    }
+    sup_profile_frames = frame->previous;
+    if (sup_profile_frames) {
+        sup_profile_frames->child_ticks += elapsed;
+    }
+}
+
+static int supProfileCompare(const void *a, const void *b) {
+    u64 x = (*(struct SupProfileSite **)a)->self_ticks;
+    u64 y = (*(struct SupProfileSite **)b)->self_ticks;
+    return (x < y) - (x > y);
+}
+
+static void supProfileWritePath(FILE *file, struct SupProfileNode *node) {
+    if (node->parent != &sup_profile_root) {
+        supProfileWritePath(file, node->parent);
+        fputc(';', file);
+    }
+    fprintf(file, "%s (%s)", node->site->name, node->site->location);
+}
+
+static void supProfileWriteFolded(FILE *file, struct SupProfileNode *node) {
+    if (node->site && node->self_ticks > 0) {
+        supProfileWritePath(file, node);
+        fprintf(file, " %llu\n", (unsigned long long)node->self_ticks);
+    }
+    for (struct SupProfileNode *child = node->first_child; child; child = child->next_sibling) {
+        supProfileWriteFolded(file, child);
+    }
+}
+
+void supProfileWrite(const char *folded_path) {
+    // Calls a fatal error ended are counted up to where it happened.
+    while (sup_profile_frames) {
+        supProfileExit(sup_profile_frames);
+    }
+    u64 count = 0;
+    u64 ticks = 0;
+    for (struct SupProfileSite *site = sup_profile_sites; site; site = site->next) {
+        count++;
+        ticks += site->self_ticks;
+    }
+    // Nothing was called, so the tree is empty too.
+    if (count == 0) {
+        return;
+    }
+    struct SupProfileSite **sites = malloc(count * sizeof(struct SupProfileSite *));
+    if (!sites) {
+        return;
+    }
+    u64 i = 0;
+    for (struct SupProfileSite *site = sup_profile_sites; site; site = site->next) {
+        sites[i++] = site;
+    }
+    qsort(sites, count, sizeof(struct SupProfileSite *), supProfileCompare);
+    fprintf(stderr, "%7s %14s %14s %12s  %s\n", "self%", "self ticks", "total ticks", "calls", "lambda");
+    for (i = 0; i < count; i++) {
+        struct SupProfileSite *site = sites[i];
+        fprintf(stderr, "%7.2f %14llu %14llu %12llu  %s (%s)\n",
+                ticks ? 100.0 * site->self_ticks / ticks : 0.0,
+                (unsigned long long)site->self_ticks,
+                (unsigned long long)site->total_ticks,
+                (unsigned long long)site->calls,
+                site->name, site->location);
+    }
+    free(sites);
+
+    FILE *file = fopen(folded_path, "w");
+    if (!file) {
+        fprintf(stderr, "could not write %s\n", folded_path);
+        return;
+    }
+    supProfileWriteFolded(file, &sup_profile_root);
+    fclose(file);
+}
+
+static inline bool gcInOldSpace(void *p) {
+    return (char *)p >= runtime.gc.old_mem && (char *)p < runtime.gc.old_end;
+}
+
+static void *gcCopy(void *p) {
+    if (!gcInOldSpace(p)) {
+        return p;
+    }
+    struct GCHeader *header = (struct GCHeader *)p - 1;
+    if (header->kind == gc_kind_forwarded) {
+        return *(void **)p;
+    }
+    u64 total = sizeof(struct GCHeader) + header->size;
+    memcpy(runtime.gc.next, header, total);
+    void *moved = runtime.gc.next + sizeof(struct GCHeader);
+    runtime.gc.next += total;
+    header->kind = gc_kind_forwarded;
+    *(void **)p = moved;
+    return moved;
+}
+
+static inline void gcCopyVariable(struct ManagedVariable *v) {
+    // Only objects can point into the heap. Literals are objects as well,
+    // gcCopy leaves them alone since they are not in the old space.
+    if (supIsObject(*v)) {
+        *v = supObjectValue(gcCopy((void *)(uintptr_t)v->bits));
+    }
+}
+
+static void gcCollectInto(u64 space_size) {
+    runtime.gc.old_mem = runtime.gc.mem;
+    runtime.gc.old_end = runtime.gc.end;
+    runtime.gc.mem = malloc(space_size);
+    if (!runtime.gc.mem) {
+        fatalError("out of memory");
+    }
+    runtime.gc.next = runtime.gc.mem;
+    runtime.gc.end = runtime.gc.mem + space_size;
+    runtime.gc.space_size = space_size;
+    runtime.gc.collections++;
+
+    gcCopyVariable(&runtime.top);
+    for (u64 i = 0; i < runtime.stack_index; i++) {
+        gcCopyVariable(&runtime.stack[i]);
+    }
+    for (struct GCFrame *frame = runtime.gc_frames; frame; frame = frame->previous) {
+        for (u64 i = 0; i < frame->count; i++) {
+            gcCopyVariable(&frame->locals[i]);
+        }
+    }
+
+    char *scan = runtime.gc.mem;
+    while (scan < runtime.gc.next) {
+        struct GCHeader *header = (struct GCHeader *)scan;
+        void *object = scan + sizeof(struct GCHeader);
+        if (header->kind == gc_kind_closure) {
+            struct Closure *closure = object;
+            for (u64 i = 0; i < closure->count; i++) {
+                gcCopyVariable(&closure->vars[i]);
+            }
+        } else if (header->kind == gc_kind_box) {
+            gcCopyVariable(&((struct Box *)object)->v);
+        }
+        scan += sizeof(struct GCHeader) + header->size;
+    }
+
+    free(runtime.gc.old_mem);
+    runtime.gc.old_mem = 0;
+    runtime.gc.old_end = 0;
+}
+
+static void gcCollect(u64 request) {
+    u64 space_size = runtime.gc.space_size ? runtime.gc.space_size : SUPPORT_GC_INITIAL_SIZE;
+    gcCollectInto(space_size);
+    // Keep at least half of the space free after a collection, otherwise
+    // we would end up collecting on almost every allocation.
+    u64 used = runtime.gc.next - runtime.gc.mem;
+    if ((used + request) * 2 > space_size) {
+        while ((used + request) * 2 > space_size) {
+            space_size *= 2;
+        }
+        gcCollectInto(space_size);
+    }
+}
+
+void *gcAlloc(u64 size, enum GCKind kind) {
+    size = (size + 7) & ~(u64)7;
+    if (size < sizeof(void *)) {
+        size = sizeof(void *);
+    }
+    u64 total = sizeof(struct GCHeader) + size;
+    if (runtime.gc.next + total > runtime.gc.end) {
+        gcCollect(total);
+    }
+    struct GCHeader *header = (struct GCHeader *)runtime.gc.next;
+    runtime.gc.next += total;
+    header->size = size;
+    header->kind = kind;
+    return header + 1;
+}
+
+struct String *gcAllocString(u64 len) {
+    struct String *s = gcAlloc(sizeof(struct String) + len + 1, gc_kind_bytes);
+    s->type = &type_string;
+    s->len = len;
+    s->bytes[len] = 0;
+    return s;
+}
+
+struct String *gcString(const char *bytes, u64 len) {
+    struct String *s = gcAllocString(len);
+    memcpy(s->bytes, bytes, len);
+    return s;
+}
+
+static void supAddBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    supReturn(argc, supNumberValue(supNumber(args[0]) + supNumber(args[1])));
+}
+
+struct ManagedType sup_builtin_add = {
+    "add", supAddBuiltin
+};
+
+static void supSubtractBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    supReturn(argc, supNumberValue(supNumber(args[0]) - supNumber(args[1])));
+}
+
+struct ManagedType sup_builtin_subtract = {
+    "subtract", supSubtractBuiltin
+};
+
+static void supEqualsBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    supReturn(argc, supNumberValue(supNumber(args[0]) == supNumber(args[1])));
+}
+
+struct ManagedType sup_builtin_equals = {
+    "equals", supEqualsBuiltin
+};
+
+static void supBitwiseOrBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    supReturn(argc, supNumberValue(supNumber(args[0]) | supNumber(args[1])));
+}
+
+struct ManagedType sup_builtin_bitwise_or = {
+    "bitwise_or", supBitwiseOrBuiltin
+};
+
+static void supBitwiseAndBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    supReturn(argc, supNumberValue(supNumber(args[0]) & supNumber(args[1])));
+}
+
+struct ManagedType sup_builtin_bitwise_and = {
+    "bitwise_and", supBitwiseAndBuiltin
+};
+
+static void supLessThanBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    supReturn(argc, supNumberValue(supNumber(args[0]) < supNumber(args[1])));
+}
+
+struct ManagedType sup_builtin_less_than = {
+    "less_than", supLessThanBuiltin
+};
+
+const char *arity_error = "called with the wrong number of arguments";
+const char *too_few_arguments_error = "attempting to read more program arguments than provided";
+static void supProgramArgumentBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 1)) {
+        return;
+    }
+    i64 index = supNumber(args[0]);
+    supDropCall(argc);
+    if (index < 0 || index >= program_args_count) {
+        fatalError(too_few_arguments_error);
+    }
+    supPushString(program_args[index]);
+}
+
+struct ManagedType sup_builtin_program_argument = {
+    "program_argument", supProgramArgumentBuiltin
+};
+
+const char *string_to_number_error = "could not convert string to number";
+const char *expected_string_error = "expected a string";
+
+/// Returns the string in the argument of a builtin.
+static inline struct String *supArgString(struct ManagedVariable *args, u64 index) {
+    if (!supIsString(args[index])) {
+        fatalError(expected_string_error);
+    }
+    return supString(args[index]);
+}
+
+static void supStringToNumberBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 1)) {
+        return;
+    }
+    if (!supIsString(args[0])) {
+        fatalError(string_to_number_error);
+    }
+    supReturn(argc, supNumberValue(strtol(supString(args[0])->bytes, 0, 0)));
+}
+
+struct ManagedType sup_builtin_string_to_number = {
+    "string_to_number", supStringToNumberBuiltin
+};
+
+static const char sup_digit_pairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+char *supFormatNumber(i64 n, char *end) {
+    u64 u = n < 0 ? -(u64)n : (u64)n;
+    while (u >= 100) {
+        const char *pair = &sup_digit_pairs[(u % 100) * 2];
+        u /= 100;
+        end -= 2;
+        end[0] = pair[0];
+        end[1] = pair[1];
+    }
+    if (u >= 10) {
+        end -= 2;
+        end[0] = sup_digit_pairs[u * 2];
+        end[1] = sup_digit_pairs[u * 2 + 1];
+    } else {
+        *--end = '0' + u;
+    }
+    if (n < 0) {
+        *--end = '-';
+    }
+    return end;
+}
+
+static void supNumberToStringBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 1)) {
+        return;
+    }
+    i64 n = supNumber(args[0]);
+    char into[24];
+    char *start = supFormatNumber(n, into + sizeof(into));
+    struct String *s = gcString(start, into + sizeof(into) - start);
+    supReturn(argc, supObjectValue(s));
+}
+
+struct ManagedType sup_builtin_number_to_string = {
+    "number_to_string", supNumberToStringBuiltin
+};
+
+static void supPutStringBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 1)) {
+        return;
+    }
+    struct String *s = supArgString(args, 0);
+    supWrite(s->bytes, s->len);
+    supWrite("\n", 1);
+    supReturn(argc, supNumberValue(s->len));
+}
+
+struct ManagedType sup_builtin_put_string = {
+    "put_string", supPutStringBuiltin
+};
+
+/// (flush value) writes out what has been printed so far and returns value.
+static void supFlushBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 1)) {
+        return;
+    }
+    supFlushOutput();
+    supReturn(argc, args[0]);
+}
+
+struct ManagedType sup_builtin_flush = {
+    "flush", supFlushBuiltin
+};
+
+static void supStringLengthBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 1)) {
+        return;
+    }
+    supReturn(argc, supNumberValue(supArgString(args, 0)->len));
+}
+
+struct ManagedType sup_builtin_string_length = {
+    "string_length", supStringLengthBuiltin
+};
+
+static void supStringConcatBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    // The arguments stay on the stack until the result is allocated,
+    // the collector may move them.
+    u64 len = supArgString(args, 0)->len + supArgString(args, 1)->len;
+    struct String *s = gcAllocString(len);
+    struct String *a = supString(args[0]);
+    struct String *b = supString(args[1]);
+    memcpy(s->bytes, a->bytes, a->len);
+    memcpy(s->bytes + a->len, b->bytes, b->len);
+    supReturn(argc, supObjectValue(s));
+}
+
+struct ManagedType sup_builtin_string_concat = {
+    "string_concat", supStringConcatBuiltin
+};
+
+const char *substring_range_error = "substring out of range";
+/// (str-sub s start count)
+static void supSubstringBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 3)) {
+        return;
+    }
+    u64 len = supArgString(args, 0)->len;
+    i64 start = supNumber(args[1]);
+    i64 count = supNumber(args[2]);
+    if (start < 0 || count < 0 || (u64)start > len || (u64)count > len - start) {
+        fatalError(substring_range_error);
+        return;
+    }
+    struct String *s = gcAllocString(count);
+    memcpy(s->bytes, supString(args[0])->bytes + start, count);
+    supReturn(argc, supObjectValue(s));
+}
+
+struct ManagedType sup_builtin_substring = {
+    "substring", supSubstringBuiltin
+};
+
+/// Returns a negative number, zero or a positive number like memcmp.
+static void supStringCompareBuiltin(u64 argc, struct ManagedVariable *args) {
+    if (!supCheckArity(argc, 2)) {
+        return;
+    }
+    struct String *a = supArgString(args, 0);
+    struct String *b = supArgString(args, 1);
+    int order = memcmp(a->bytes, b->bytes, a->len < b->len ? a->len : b->len);
+    if (order == 0) {
+        order = (a->len > b->len) - (a->len < b->len);
+    }
+    supReturn(argc, supNumberValue(order));
+}
+
+struct ManagedType sup_builtin_string_compare = {
+    "string_compare", supStringCompareBuiltin
+};
@@ -8,283 +8,427 @@
 
 /// The support header file contains procedures
 /// that are used by the output of the LOL compiler.
+/// Everything that is not small enough to be inlined into the generated
+/// code lives in support.c, which is built once as the LOLFramework
+/// library.
 
 typedef int64_t i64;
 typedef uint64_t u64;
+typedef uint32_t u32;
 
-const char *crash_message = 0;
-const char **program_args = 0;
-i64 program_args_count = 0;
+extern const char *crash_message;
+extern const char **program_args;
+extern i64 program_args_count;
+/// Where the folded stacks go in a profiled program, fatal errors write
+/// the profile there before exiting, see supProfileWrite.
+extern const char *profile_path;
 
-static inline void fatalError(const char *message) {
-    crash_message = message;
-#ifndef SUPPORT_IGNORE_FATAL_ERRORS
-    fprintf(stderr, "error: %s\n", message);
-    exit(1);
-#endif
-}
+void fatalError(const char *message);
 
+struct ManagedVariable;
 
+/// Every callable is called with the number of arguments and a pointer to
+/// the first of them, see supCall.
 struct ManagedType {
     const char *name;
-    void const (*func)();
+    void (*func)(u64 argc, struct ManagedVariable *args);
+};
+
+extern const char *call_number_error;
+extern const char *call_string_error;
+extern const char *call_box_error;
+extern const char *too_few_arguments_error;
+extern const char *arity_error;
+extern const char *string_to_number_error;
+extern const char *expected_string_error;
+extern const char *substring_range_error;
+
+extern struct ManagedType type_number;
+extern struct ManagedType type_string;
+/// String literals are static data in the generated program, they are
+/// never written to and the collector leaves them where they are.
+extern struct ManagedType type_literal_string;
+extern struct ManagedType type_box;
+
+/// A value is a single tagged word:
+///
+///     ...xxx1  a number, shifted left by one
+///     ...x010  a lambda without an environment, its ManagedType + 2
+///     ...x000  a pointer to an object that starts with its ManagedType,
+///              a String, a Closure or a Box
+///
+/// so numbers are 63 bits and telling them apart takes a bit test.
+struct ManagedVariable {
+    u64 bits;
 };
 
+#define SUP_TAG_NUMBER 1
+#define SUP_TAG_LAMBDA 2
+#define SUP_TAG_MASK 3
 
-static const char *call_number_error = "attempted to invoke a number";
-static void callNumberError() {
-    fatalError(call_number_error);
-}
-struct ManagedType type_number = {
-    "number", (const void*)callNumberError
+/// Strings know their length. The bytes are followed by a NUL as well,
+/// so they can be handed to C functions as they are.
+struct String {
+    struct ManagedType *type;
+    u64 len;
+    char bytes[];
 };
 
-static const char *call_string_error = "attempted to invoke a string";
-static void callStringError() {
-    fatalError(call_string_error);
-}
-struct ManagedType type_string = {
-    "string", (const void*)callStringError
+/// Defines a literal with the same layout as struct String.
+#define SUP_STRING_LITERAL(name, text) \
+    static const struct { struct ManagedType *type; u64 len; char bytes[sizeof(text)]; } name = { &type_literal_string, sizeof(text) - 1, text }
+
+/// The environment of a closure. It holds a copy of every variable the
+/// lambda captures, or a reference to a Box for the ones that are boxed.
+/// `type` is the type of the lambda.
+struct Closure {
+    struct ManagedType *type;
+    u64 count;
+    struct ManagedVariable vars[];
 };
 
-struct ManagedVariable {
+/// A captured variable that is set after it has been captured.
+struct Box {
     struct ManagedType *type;
-    union ManagedVariableValue {
-        i64 number;
-        char *string;
-        void *context;
-    } v;
+    struct ManagedVariable v;
 };
 
-struct HeapVariable {
-    struct HeapVariable *previous;
+static inline bool supIsNumber(struct ManagedVariable v) {
+    return v.bits & SUP_TAG_NUMBER;
+}
+
+static inline i64 supNumber(struct ManagedVariable v) {
+    return (i64)v.bits >> 1;
+}
+
+static inline struct ManagedVariable supNumberValue(i64 n) {
     struct ManagedVariable v;
+    v.bits = ((u64)n << 1) | SUP_TAG_NUMBER;
+    return v;
+}
+
+/// For the Strings, Closures and Boxes, which start with their type.
+static inline struct ManagedVariable supObjectValue(void *object) {
+    struct ManagedVariable v;
+    v.bits = (u64)(uintptr_t)object;
+    return v;
+}
+
+static inline bool supIsObject(struct ManagedVariable v) {
+    return v.bits != 0 && (v.bits & SUP_TAG_MASK) == 0;
+}
+
+/// The type of `v`, &type_number for numbers. Lambdas and closures have
+/// the type of the lambda.
+static inline struct ManagedType *supType(struct ManagedVariable v) {
+    if (v.bits & SUP_TAG_NUMBER) {
+        return &type_number;
+    }
+    if (v.bits & SUP_TAG_LAMBDA) {
+        return (struct ManagedType *)(uintptr_t)(v.bits - SUP_TAG_LAMBDA);
+    }
+    return *(struct ManagedType **)(uintptr_t)v.bits;
+}
+
+static inline struct String *supString(struct ManagedVariable v) {
+    return (struct String *)(uintptr_t)v.bits;
+}
+
+/// Every generated lambda keeps its bindings in a `locals` array on the
+/// C stack and links it into this list so the collector can find them.
+struct GCFrame {
+    struct GCFrame *previous;
+    u64 count;
+    struct ManagedVariable *locals;
+};
+
+/// Every object returned by gcAlloc is preceded by a header. The kind
+/// tells the collector how to scan the object. Once an object has been
+/// evacuated its kind becomes gc_kind_forwarded and the first word of
+/// the payload holds the new address.
+enum GCKind {
+    gc_kind_bytes,
+    gc_kind_closure,
+    gc_kind_box,
+    gc_kind_forwarded,
+};
+
+struct GCHeader {
+    u32 size;
+    u32 kind;
 };
-struct HeapVariable *context_stack = 0;
 
+#ifndef SUPPORT_GC_INITIAL_SIZE
+#define SUPPORT_GC_INITIAL_SIZE (1 << 20)
+#endif
+
+/// A semispace copying collector. Allocation bumps `next` towards `end`,
+/// when the space runs out live objects are copied Cheney style into a
+/// fresh space and the old one is released.
 struct GC {
-    void *mem;
-    void *old_mem;
-} gc;
+    char *mem;
+    char *next;
+    char *end;
+    char *old_mem;
+    char *old_end;
+    u64 space_size;
+    u64 collections;
+};
 
-static void *gcAlloc(u64 size) {
-    // TODO: We leak right now. I will implement a copying gc later.
-    return malloc(size);
-}
+// The sizes below change the layout of struct Runtime, support.c has to
+// be built with the same ones as the program.
+#ifndef SUPPORT_STACK_SIZE
+#define SUPPORT_STACK_SIZE (1 << 20)
+#endif
 
-struct ManagedVariable stack[1024];
-struct ManagedVariable top;
-unsigned int stack_index = 0;
+#ifndef SUPPORT_OUTPUT_SIZE
+#define SUPPORT_OUTPUT_SIZE (1 << 16)
+#endif
+
+/// Everything a running program mutates. Each thread has its own, so
+/// several programs can run in one process.
+struct Runtime {
+    /// The value on top of the stack is kept in `top`, the rest are in
+    /// `stack[0..stack_index)`.
+    struct ManagedVariable *stack;
+    struct ManagedVariable top;
+    u64 stack_index;
+    struct GCFrame *gc_frames;
+    struct GC gc;
+    /// See supTailCall.
+    bool tail_call_pending;
+    u64 tail_call_argc;
+    /// Output is collected here and written to stdout in large chunks.
+    u64 output_len;
+    char output[SUPPORT_OUTPUT_SIZE];
+};
 
-struct ManagedVariable binds[1024];
-typedef unsigned int BindsIndex;
-BindsIndex binds_index = 0;
+extern _Thread_local struct Runtime runtime;
 
+/// Reserves the stack of the calling thread. Calling it again does
+/// nothing.
+void supRuntimeInit(void);
+void supFlushOutput(void);
+void supWrite(const char *bytes, u64 len);
+
+void *gcAlloc(u64 size, enum GCKind kind);
+/// Allocates a string of `len` bytes, the caller fills them in.
+struct String *gcAllocString(u64 len);
+struct String *gcString(const char *bytes, u64 len);
 
 static inline void supStackDup() {
-    stack[stack_index] = top;
-    stack_index++;
+    runtime.stack[runtime.stack_index] = runtime.top;
+    runtime.stack_index++;
 }
 
 static inline void supStackDrop() {
-    stack_index--;
-    top = stack[stack_index];
+    runtime.stack_index--;
+    runtime.top = runtime.stack[runtime.stack_index];
 }
 
 static inline void supPushNumber(i64 n) {
     supStackDup();
-    top.type = &type_number;
-    top.v.number = n;
-}
-
-static inline void supPushString(const char *src) {
-    supStackDup();
-    top.type = &type_string;
-    top.v.string = strdup(src);
+    runtime.top = supNumberValue(n);
 }
 
-static inline void supPushLambda(struct ManagedType *lambda_type) {
+static inline void supPushBytes(const char *bytes, u64 len) {
+    struct String *s = gcString(bytes, len);
     supStackDup();
-    top.type = lambda_type;
-    top.v.context = context_stack;
+    runtime.top = supObjectValue(s);
 }
 
-static inline void supBind() {
-    binds_index++;
-    binds[binds_index] = top;
-    supStackDrop();
-}
-
-static inline void supBindCaptured() {
-    struct HeapVariable *previous_context = context_stack;
-    context_stack = gcAlloc(sizeof(struct HeapVariable));
-    context_stack->previous = previous_context;
-    context_stack->v = top;
-    supStackDrop();
+static inline void supPushString(const char *src) {
+    supPushBytes(src, strlen(src));
 }
 
-static inline void supSet(int n) {
-    binds[binds_index - n] = top;
-    supStackDrop();
+/// Pushes a literal defined with SUP_STRING_LITERAL.
+static inline void supPushLiteral(const void *s) {
+    supStackDup();
+    runtime.top = supObjectValue((void *)s);
 }
 
-static inline void supSetCaptured(int n) {
-    struct HeapVariable *context = context_stack;
-    for(int i = 0; i < n; i++) {
-        context = context->previous;
+static inline bool supIsString(struct ManagedVariable v) {
+    if (!supIsObject(v)) {
+        return false;
     }
-    context->v = top;
-    supStackDrop();
+    struct ManagedType *type = supString(v)->type;
+    return type == &type_string || type == &type_literal_string;
 }
 
-static inline void supGet(int n) {
+static inline void supPushLambda(struct ManagedType *lambda_type) {
     supStackDup();
-    top = binds[binds_index - n];
+    runtime.top.bits = (u64)(uintptr_t)lambda_type + SUP_TAG_LAMBDA;
 }
 
-
-static inline void supGetCaptured(int n) {
-    struct HeapVariable *context = context_stack;
-    for(int i = 0; i < n; i++) {
-        context = context->previous;
-    }
+static inline void supPushClosure(struct ManagedType *lambda_type, u64 count) {
+    u64 size = sizeof(struct Closure) + count * sizeof(struct ManagedVariable);
+    struct Closure *closure = gcAlloc(size, gc_kind_closure);
+    memset(closure, 0, size);
+    closure->type = lambda_type;
+    closure->count = count;
     supStackDup();
-    top = context->v;
+    runtime.top = supObjectValue(closure);
 }
 
-static inline void supCall() {
-    top.type->func();
+static inline struct Closure *supEnv(struct ManagedVariable v) {
+    return (struct Closure *)(uintptr_t)v.bits;
 }
 
-static inline void supAddBuiltin() {
-    stack_index--;
-    i64 a = stack[stack_index].v.number;
-    stack_index--;
-    top.type = &type_number;
-    top.v.number = a + stack[stack_index].v.number;
+static inline struct Box *supBox(struct ManagedVariable v) {
+    return (struct Box *)(uintptr_t)v.bits;
 }
 
-struct ManagedType sup_builtin_add = {
-    "add", (const void*)supAddBuiltin
-};
-
-static inline void supSubtractBuiltin() {
-    stack_index--;
-    i64 a = stack[stack_index].v.number;
-    stack_index--;
-    top.type = &type_number;
-    top.v.number = stack[stack_index].v.number - a;
+static inline void supPushValue(struct ManagedVariable v) {
+    supStackDup();
+    runtime.top = v;
 }
 
-struct ManagedType sup_builtin_subtract = {
-    "subtract", (const void*)supSubtractBuiltin
-};
-
-static inline void supEqualsBuiltin() {
-    stack_index--;
-    i64 a = stack[stack_index].v.number;
-    stack_index--;
-    top.type = &type_number;
-    top.v.number = stack[stack_index].v.number == a;
+/// Boxes `*value` into `local`. `value` has to be a root, the collector
+/// may run before it is read.
+static inline void supBoxInto(struct ManagedVariable *local, struct ManagedVariable *value) {
+    struct Box *box = gcAlloc(sizeof(struct Box), gc_kind_box);
+    box->type = &type_box;
+    box->v = *value;
+    *local = supObjectValue(box);
 }
 
-struct ManagedType sup_builtin_equals = {
-    "equals", (const void*)supEqualsBuiltin
-};
-
-static inline void supBitwiseOrBuiltin() {
-    stack_index--;
-    i64 a = stack[stack_index].v.number;
-    stack_index--;
-    top.type = &type_number;
-    top.v.number = stack[stack_index].v.number | a;
+static inline void supBindBox(struct ManagedVariable *local) {
+    supBoxInto(local, &runtime.top);
+    supStackDrop();
 }
 
-struct ManagedType sup_builtin_bitwise_or = {
-    "bitwise_or", (const void*)supBitwiseOrBuiltin
-};
-
-static inline void supBitwiseAndBuiltin() {
-    stack_index--;
-    i64 a = stack[stack_index].v.number;
-    stack_index--;
-    top.type = &type_number;
-    top.v.number = stack[stack_index].v.number & a;
+/// The arguments of a call with `argc` arguments, in the order they were
+/// pushed. They sit right below the callee, which is in top.
+static inline struct ManagedVariable *supArgs(u64 argc) {
+    return &runtime.stack[runtime.stack_index - argc];
 }
 
-struct ManagedType sup_builtin_bitwise_and = {
-    "bitwise_and", (const void*)supBitwiseAndBuiltin
-};
+/// Returns false after reporting the error if a callable taking `arity`
+/// arguments is called with `argc`.
+static inline bool supCheckArity(u64 argc, u64 arity) {
+    if (argc != arity) {
+        fatalError(arity_error);
+        return false;
+    }
+    return true;
+}
 
-static inline void supLessThanBuiltin() {
-    stack_index--;
-    i64 a = stack[stack_index].v.number;
-    stack_index--;
-    top.type = &type_number;
-    top.v.number = stack[stack_index].v.number < a;
+/// Removes the callee and its `argc` arguments, once the callee is done
+/// reading them.
+static inline void supDropCall(u64 argc) {
+    runtime.stack_index -= argc + 1;
+    runtime.top = runtime.stack[runtime.stack_index];
 }
 
-struct ManagedType sup_builtin_less_than = {
-    "less_than", (const void*)supLessThanBuiltin
-};
+/// Replaces the callee and its `argc` arguments with the result `v`.
+static inline void supReturn(u64 argc, struct ManagedVariable v) {
+    runtime.stack_index -= argc;
+    runtime.top = v;
+}
 
-const char *too_few_arguments_error = "attempting to read more program arguments than provided";
-static inline void supProgramArgumentBuiltin() {
-    stack_index--;
-    i64 index = stack[stack_index].v.number;
-    supStackDrop();
-    if (index < 0 || index >= program_args_count) {
-        fatalError(too_few_arguments_error);
+static inline void supRunTailCalls() {
+    while (runtime.tail_call_pending) {
+        runtime.tail_call_pending = false;
+        u64 argc = runtime.tail_call_argc;
+        supType(runtime.top)->func(argc, supArgs(argc));
     }
-    supPushString(program_args[index]);
 }
 
-struct ManagedType sup_builtin_program_argument = {
-    "program_argument", (const void*)supProgramArgumentBuiltin
-};
+/// Calls the callee in top with the `argc` values below it. The callee
+/// checks `argc` and replaces itself and the arguments with its result.
+static inline void supCall(u64 argc) {
+    supType(runtime.top)->func(argc, supArgs(argc));
+    supRunTailCalls();
+}
 
-const char *string_to_number_error = "could not convert string to number";
-static inline void supStringToNumberBuiltin() {
-    stack_index--;
-    char *s = stack[stack_index].v.string;
-    if (stack[stack_index].type != &type_string) {
-        fatalError(string_to_number_error);
-    }
-    top.v.number = strtol(s, 0, 0);
-    top.type = &type_number;
+/// Like supCall, for a callee the compiler knows takes `argc` arguments.
+/// `func` is the function of its type, calling it directly lets the C
+/// compiler inline it and drop the arity check. When the arguments were
+/// never pushed, the compiler calls the _direct function of the callee
+/// with them instead.
+static inline void supCallKnown(void (*func)(u64, struct ManagedVariable *), u64 argc) {
+    func(argc, supArgs(argc));
+    supRunTailCalls();
 }
 
-struct ManagedType sup_builtin_string_to_number = {
-    "string_to_number", (const void*)supStringToNumberBuiltin
-};
+/// Used by a lambda that returns instead of making the call in its tail
+/// position itself, the callee is in top with its `argc` arguments below.
+/// supCall then makes the call, so chains of tail calls run in constant C
+/// stack space.
+static inline void supTailCall(u64 argc) {
+    runtime.tail_call_pending = true;
+    runtime.tail_call_argc = argc;
+}
 
+/// Used by the inlined arithmetic emitted by the compiler.
+static inline i64 supPopNumber() {
+    i64 n = supNumber(runtime.top);
+    supStackDrop();
+    return n;
+}
 
-static inline void supNumberToStringBuiltin() {
-    stack_index--;
-    i64 n = stack[stack_index].v.number;
-    char into[64];
-    snprintf(into, sizeof(into), "%ld", n);
-    top.v.string = strdup(into);
-    top.type = &type_string;
+static inline void supSetNumber(i64 n) {
+    runtime.top = supNumberValue(n);
 }
 
-struct ManagedType sup_builtin_number_to_string = {
-    "number_to_string", (const void*)supNumberToStringBuiltin
+/// Every lambda of a program compiled with --profile has one of these,
+/// the entry and exit of each call is recorded in it and in the calling
+/// context tree, see supProfileEnter.
+struct SupProfileSite {
+    const char *name;
+    /// file:line of the lambda.
+    const char *location;
+    u64 calls;
+    u64 self_ticks;
+    u64 total_ticks;
+    /// Calls of the lambda that are running, recursive calls only count
+    /// towards total_ticks once.
+    u64 active;
+    struct SupProfileSite *next;
 };
 
-static inline void supPutStringBuiltin() {
-    stack_index--;
-    char *s = stack[stack_index].v.string;
-    if (stack[stack_index].type != &type_string) {
-        fatalError(string_to_number_error);
-    }
-    puts(s);
-    top.v.number = strlen(s);
-    top.type = &type_number;
-}
+/// A node of the calling context tree. Direct recursion stays in the same
+/// node, so the tree does not get as deep as the recursion.
+struct SupProfileNode {
+    struct SupProfileSite *site;
+    struct SupProfileNode *parent;
+    struct SupProfileNode *first_child;
+    struct SupProfileNode *next_sibling;
+    u64 self_ticks;
+};
 
-struct ManagedType sup_builtin_put_string = {
-    "put_string", (const void*)supPutStringBuiltin
+/// Lives on the C stack of an instrumented lambda while it runs.
+struct SupProfileFrame {
+    struct SupProfileFrame *previous;
+    struct SupProfileNode *node;
+    u64 start;
+    u64 child_ticks;
 };
 
+void supProfileEnter(struct SupProfileFrame *frame, struct SupProfileSite *site);
+void supProfileExit(struct SupProfileFrame *frame);
+/// Prints the flat profile to stderr and writes the calling context tree
+/// to `folded_path` as folded stacks, one line per path with its ticks.
+void supProfileWrite(const char *folded_path);
+
+/// Writes the decimal digits of `n` so that they end right before `end`,
+/// two at a time. Returns where they start.
+char *supFormatNumber(i64 n, char *end);
+
+extern struct ManagedType sup_builtin_add;
+extern struct ManagedType sup_builtin_subtract;
+extern struct ManagedType sup_builtin_equals;
+extern struct ManagedType sup_builtin_bitwise_or;
+extern struct ManagedType sup_builtin_bitwise_and;
+extern struct ManagedType sup_builtin_less_than;
+extern struct ManagedType sup_builtin_program_argument;
+extern struct ManagedType sup_builtin_string_to_number;
+extern struct ManagedType sup_builtin_number_to_string;
+extern struct ManagedType sup_builtin_put_string;
+extern struct ManagedType sup_builtin_flush;
+extern struct ManagedType sup_builtin_string_length;
+extern struct ManagedType sup_builtin_string_concat;
+extern struct ManagedType sup_builtin_substring;
+extern struct ManagedType sup_builtin_string_compare;
+
 #endif
@@ -2,262 +2,318 @@
 
 const std = @import("std");
 
+// support.c is built with SUPPORT_IGNORE_FATAL_ERRORS, so fatal errors
+// only set crash_message.
 const support = @cImport({
-    @cDefine("SUPPORT_IGNORE_FATAL_ERRORS", "1");
     @cInclude("support.h");
 });
 
+fn testString(v: support.ManagedVariable) []const u8 {
+    var string = support.supString(v);
+    return string.*.bytes()[0..string.*.len];
+}
+
 test "gcAlloc" {
-    var mem = support.gcAlloc(32);
-    _ = mem;
+    var mem: [*]u8 = @ptrCast(support.gcAlloc(32, support.gc_kind_bytes));
+    mem[31] = 1;
 }
 
-test "push bind then get" {
+test "frame locals survive collections" {
+    support.supRuntimeInit();
+    var locals = [_]support.ManagedVariable{std.mem.zeroes(support.ManagedVariable)} ** 2;
+    var frame = support.GCFrame{
+        .previous = support.runtime.gc_frames,
+        .count = locals.len,
+        .locals = &locals,
+    };
+    support.runtime.gc_frames = &frame;
+    defer support.runtime.gc_frames = frame.previous;
+
     support.supPushNumber(32);
-    support.supBind();
-    support.supPushNumber(42);
-    support.supPushNumber(52);
-    support.supBind();
-    support.supGet(1);
-    try std.testing.expectEqual(support.top.v.number, 32);
-    support.supGet(0);
-    try std.testing.expectEqual(support.top.v.number, 52);
+    locals[0] = support.runtime.top;
+    support.supStackDrop();
+    support.supPushString("kept");
+    locals[1] = support.runtime.top;
+    support.supStackDrop();
+
+    var collections = support.runtime.gc.collections;
+    while (support.runtime.gc.collections < collections + 2) {
+        support.supPushString("garbage");
+        support.supStackDrop();
+    }
+    support.supPushValue(locals[0]);
+    try std.testing.expectEqual(support.supNumber(support.runtime.top), 32);
+    support.supPushValue(locals[1]);
+    try std.testing.expectEqualStrings("kept", testString(support.runtime.top));
 }
 
 test "crash supCall" {
+    support.supRuntimeInit();
     support.supPushNumber(32);
-    support.supCall();
+    support.supCall(0);
     try std.testing.expectEqual(support.call_number_error, support.crash_message);
 }
 
 
 test "custom call" {
+    support.supRuntimeInit();
     support.supPushNumber(32);
     support.supPushNumber(32);
     // TODO: Implement later.
 }
 
-test "captured get and bind" {
+test "closure environment" {
+    support.supRuntimeInit();
+    var lambda_type = support.ManagedType{ .name = "test", .func = null };
+    support.supPushClosure(&lambda_type, 2);
+    support.supEnv(support.runtime.top).*.vars()[0] = support.supNumberValue(1);
+    support.supEnv(support.runtime.top).*.vars()[1] = support.supNumberValue(2);
+    try std.testing.expectEqual(support.supEnv(support.runtime.top).*.count, 2);
+    try std.testing.expectEqual(support.supNumber(support.supEnv(support.runtime.top).*.vars()[1]), 2);
+    support.supStackDrop();
+}
+
+test "gc keeps closures and boxes alive" {
+    support.supRuntimeInit();
+    var locals = [_]support.ManagedVariable{std.mem.zeroes(support.ManagedVariable)} ** 2;
+    var frame = support.GCFrame{
+        .previous = support.runtime.gc_frames,
+        .count = locals.len,
+        .locals = &locals,
+    };
+    support.runtime.gc_frames = &frame;
+    defer support.runtime.gc_frames = frame.previous;
+
+    support.supPushNumber(7);
+    support.supBindBox(&locals[0]);
+    var lambda_type = support.ManagedType{ .name = "test", .func = null };
+    support.supPushClosure(&lambda_type, 1);
+    support.supEnv(support.runtime.top).*.vars()[0] = locals[0];
+    locals[1] = support.runtime.top;
+    support.supStackDrop();
+
+    var collections = support.runtime.gc.collections;
+    while (support.runtime.gc.collections < collections + 4) {
+        support.supPushString("garbage");
+        support.supStackDrop();
+    }
+    support.supBox(locals[0]).*.v = support.supNumberValue(8);
+    var env = support.supEnv(locals[1]);
+    try std.testing.expectEqual(support.supNumber(support.supBox(env.*.vars()[0]).*.v), 8);
+}
+
+test "gc memory stays flat" {
+    support.supRuntimeInit();
+    for (0..100000) |_| {
+        support.supPushString("this string becomes garbage right away");
+        support.supStackDrop();
+    }
+    var space_size = support.runtime.gc.space_size;
+    for (0..100000) |_| {
+        support.supPushString("this string becomes garbage right away");
+        support.supStackDrop();
+    }
+    try std.testing.expectEqual(space_size, support.runtime.gc.space_size);
+}
+
+var tail_call_count: i64 = 0;
+var tail_call_type = support.ManagedType{ .name = "tail", .func = @ptrCast(&tailCallingLambda) };
+
+fn tailCallingLambda(argc: u64, args: [*c]support.ManagedVariable) callconv(.C) void {
+    _ = args;
+    support.supDropCall(argc);
+    tail_call_count += 1;
+    if (tail_call_count < 100000) {
+        support.supPushLambda(&tail_call_type);
+        support.supTailCall(0);
+    }
+}
+
+test "tail calls are made by the caller" {
+    support.supRuntimeInit();
+    var stack_index = support.runtime.stack_index;
+    support.supPushLambda(&tail_call_type);
+    support.supCall(0);
+    try std.testing.expectEqual(@as(i64, 100000), tail_call_count);
+    try std.testing.expectEqual(stack_index, support.runtime.stack_index);
+}
+
+test "builtins check their arity" {
+    support.supRuntimeInit();
+    var stack_index = support.runtime.stack_index;
     support.supPushNumber(1);
     support.supPushNumber(2);
-    support.supPushNumber(3);
-    support.supBindCaptured();
-    support.supBindCaptured();
-    support.supBindCaptured();
-    support.supGetCaptured(1);
-    try std.testing.expectEqual(support.top.v.number, 2);
-    support.supGetCaptured(0);
-    try std.testing.expectEqual(support.top.v.number, 1);
-    support.supGetCaptured(2);
-    try std.testing.expectEqual(support.top.v.number, 3);
+    support.supPushLambda(&support.sup_builtin_add);
+    support.supCall(2);
+    try std.testing.expectEqual(@as(i64, 3), support.supNumber(support.runtime.top));
+    support.supStackDrop();
+    try std.testing.expectEqual(stack_index, support.runtime.stack_index);
 
+    support.supPushNumber(1);
+    support.supPushLambda(&support.sup_builtin_add);
+    support.supCall(1);
+    try std.testing.expectEqual(support.arity_error, support.crash_message);
+    support.supDropCall(1);
+}
+
+test "runtime is per thread" {
+    support.supRuntimeInit();
+    support.supPushNumber(1);
+    defer support.supStackDrop();
+    var thread_stack_index: u64 = 1;
+    var thread = try std.Thread.spawn(.{}, struct {
+        fn run(stack_index: *u64) void {
+            support.supRuntimeInit();
+            stack_index.* = support.runtime.stack_index;
+        }
+    }.run, .{&thread_stack_index});
+    thread.join();
+    try std.testing.expectEqual(@as(u64, 0), thread_stack_index);
 }
 
-// const VariableTag = enum(c_int) {
-//     none,
-//     context_parent,
-//     context_end,
-//     var_number,
-//     var_closure,
-//     var_str,
-//     closure_function_ptr,
-// };
-// 
-// const ManagedVariable = extern struct {
-//     v: extern union {
-//         none: u64,
-//         number: i64,
-//         str: [*:0]const u8,
-//         closure: [*]ManagedVariable,
-//         parent: [*]ManagedVariable,
-//         /// Exists for context_end
-//         relocation: [*]ManagedVariable,
-//     },
-//     tag: VariableTag,
-// };
-// 
-// var no_context = [_]ManagedVariable {
-//     ManagedVariable {
-//         .v = .{ .none = 0 },
-//         .tag = .context_end,
-//     }
-// };
-// 
-// const GC = struct {
-//     fba: std.heap.FixedBufferAllocator,
-//     old_memory: []u8,
-// };
-// 
-// fn copyHeapContextToHeap(gc: *GC, ctx: [*]ManagedVariable) [*]ManagedVariable {
-//     var size: usize = 0;
-//     for (0..1024) |i| {
-//         var context = &ctx[i];
-//         if (context.tag == .context_end) {
-//             size = i;
-//             break;
-//         }
-//     }
-// 
-//     var new_context = gcAlloc(gc, ctx, ManagedVariable, size + 1);
-//     for (0..1024) |i| {
-//         new_context[i] = ctx[i];
-//         if (new_context[i].tag == .context_end) {
-//             return new_context.ptr;
-//         }
-//     }
-// 
-//     @panic("context is longer than 1024");
-// }
-// 
-// fn gcScanClosure(gc: *GC, ctx: [*]ManagedVariable) [*]ManagedVariable {
-//     var size: usize = 0;
-//     for (0..1024) |i| {
-//         var context = &ctx[i];
-//         if (context.tag == .context_end) {
-//             if (gc.fba.ownsPtr(@ptrCast(context.v.relocation))) {
-//                 return context.v.relocation;
-//             }
-//             size = i;
-//             break;
-//         }
-//     }
-// 
-//     var new_context = gcAlloc(gc, &no_context, ManagedVariable, size + 1);
-//     for (0..1024) |i| {
-//         gcScanManagedVariable(gc, &new_context[i], &ctx[i]);
-//         if (new_context[i].tag == .context_end) {
-//             ctx[i].v.relocation = new_context.ptr;
-//             return new_context.ptr;
-//         }
-//     }
-// 
-//     @panic("context is longer than 1024");
-// 
-// }
-// 
-// fn gcScanManagedVariable(gc: *GC, v: *ManagedVariable, into: *ManagedVariable) void {
-//     switch (v.tag) {
-//         .var_closure => {
-//             into.tag = .var_closure;
-//             into.v.closure = gcScanClosure(gc, v.v.closure);
-//         },
-//         else => {
-//             v.* = into.*;
-//         }
-//     }
-// }
-// 
-// fn gcScanStack(gc: *GC, ctx: [*]ManagedVariable) void {
-//     for (0..1024) |i| {
-//         var context = &ctx[i];
-//         if (context.tag == .context_end) {
-//             return;
-//         } else if (context.tag == .var_closure) {
-//              gcScanManagedVariable(gc, &context.v.closure[0], context);
-//         } else if (context.tag == .context_parent) {
-//             return gcScanStack(gc, context.v.parent);
-//         }
-//     }
-//     @panic("context is longer than 1024");
-// }
-// 
-// fn gcAlloc(gc: *GC, ctx: [*]ManagedVariable, comptime T: type, n: usize) []T {
-//     return gc.fba.allocator().alloc(T, n) catch blk: {
-//         const allocator = std.heap.page_allocator;
-//         // TODO: panic if error is caught during gc scan.
-// 
-//         // We add 16 because we are paranoid about alignment or something...
-//         // No clue if this is really required.
-//         const min_target_size = gc.fba.buffer.len + @sizeOf(T) * n + 16;
-//         var target_size: usize = 1;
-//         while (target_size < min_target_size) {
-//             target_size <<= 1; // Could be optimized using @clz.
-//         }
-//         const new_memory = allocator.alloc(u8, target_size) catch {
-//             @panic("out of memory!");
-//         };
-// 
-//         gc.old_memory = gc.fba.buffer;
-// 
-//         gc.fba = std.heap.FixedBufferAllocator.init(new_memory);
-//         gcScanStack(gc, ctx);
-// 
-//         allocator.free(gc.old_memory);
-// 
-//         break :blk gc.fba.allocator().alloc(T, n) catch {
-//             @panic("gc is failing weirdly");
-//         };
-//     };
-// }
-// 
-// fn moveCurrentContextToHeap(gc: *GC, ctx: [*]ManagedVariable) [*]ManagedVariable {
-//     if (gc.fba.ownsPtr(ctx)) {
-//         // Already on the heap! No moves is required.
-//         return ctx;
-//     }
-// 
-//     var size: usize = 0;
-//     for (0..1024) |i| {
-//         var context = &ctx[i];
-//         if (context.tag == .context_end) {
-//             size = i;
-//             break;
-//         }
-//     }
-// 
-//     var new_context = gcAlloc(gc, ctx, ManagedVariable, size + 1);
-//     for (0..1024) |i| {
-//         new_context[i] = ctx[i];
-//         if (new_context[i].tag == .context_end) {
-//             return new_context.ptr;
-//         }
-//     }
-// 
-//     @panic("context is longer than 1024");
-// }
-// 
-// test "managed_variable_size" {
-//     try std.testing.expectEqual(16, @sizeOf(ManagedVariable));
-// }
-// 
-// 
-// test "gc_alloc" {
-//     const allocator = std.heap.page_allocator;
-//     const mem = try allocator.alloc(u8, 1);
-//     var gc = GC {
-//         .fba = std.heap.FixedBufferAllocator.init(mem),
-//         .old_memory = undefined
-//     };
-//     var ctx = [_]ManagedVariable {
-//         ManagedVariable {
-//             .tag = .context_end,
-//             .v = .{.none = 0},
-//         },
-//     };
-//     var thing = gcAlloc(&gc, &ctx, u8, 31);
-//     thing[0] = 'h';
-//     thing[1] = 'i';
-//     thing[2] = 0;
-// }
-// 
-// test "gc_alloc_context" {
-//     const allocator = std.heap.page_allocator;
-//     const mem = try allocator.alloc(u8, 1);
-//     var gc = GC {
-//         .fba = std.heap.FixedBufferAllocator.init(mem),
-//         .old_memory = undefined
-//     };
-//     var ctx = [_]ManagedVariable {
-//         ManagedVariable {
-//             .tag = .var_number,
-//             .v = .{.number = 333},
-//         },
-//         ManagedVariable {
-//             .tag = .context_end,
-//             .v = .{.none = 0},
-//         },
-//     };
-//     var new_ctx = moveCurrentContextToHeap(&gc, &ctx);
-//     try std.testing.expectEqual(new_ctx[0].v.number, 333);
-// }
-// 
+test "literal strings are not copied" {
+    support.supRuntimeInit();
+    const literal = extern struct { type: *support.ManagedType, len: u64, bytes: [8]u8 }{
+        .type = &support.type_literal_string,
+        .len = 7,
+        .bytes = "literal\x00".*,
+    };
+    support.supPushLiteral(&literal);
+    var collections = support.runtime.gc.collections;
+    while (support.runtime.gc.collections < collections + 2) {
+        support.supPushString("garbage");
+        support.supStackDrop();
+    }
+    try std.testing.expect(support.supIsString(support.runtime.top));
+    try std.testing.expectEqual(@intFromPtr(&literal), support.runtime.top.bits);
+    support.supStackDrop();
+}
+
+test "string builtins" {
+    support.supRuntimeInit();
+    var stack_index = support.runtime.stack_index;
+    support.supPushString("hello ");
+    support.supPushNumber(-1234567);
+    support.supPushLambda(&support.sup_builtin_number_to_string);
+    support.supCall(1);
+    support.supPushLambda(&support.sup_builtin_string_concat);
+    support.supCall(2);
+    try std.testing.expectEqualStrings("hello -1234567", testString(support.runtime.top));
+
+    support.supPushNumber(6);
+    support.supPushNumber(2);
+    support.supPushLambda(&support.sup_builtin_substring);
+    support.supCall(3);
+    try std.testing.expectEqualStrings("-1", testString(support.runtime.top));
+
+    support.supPushString("-2");
+    support.supPushLambda(&support.sup_builtin_string_compare);
+    support.supCall(2);
+    try std.testing.expect(support.supNumber(support.runtime.top) < 0);
+    support.supStackDrop();
+    try std.testing.expectEqual(stack_index, support.runtime.stack_index);
+
+    var digits: [24]u8 = undefined;
+    var end: [*c]u8 = @ptrCast(&digits);
+    end += digits.len;
+    var start = support.supFormatNumber(std.math.minInt(i64), end);
+    try std.testing.expectEqualStrings("-9223372036854775808", start[0 .. @intFromPtr(end) - @intFromPtr(start)]);
+}
+
+test "values are one word" {
+    support.supRuntimeInit();
+    try std.testing.expectEqual(@as(usize, 8), @sizeOf(support.ManagedVariable));
+    var n = support.supNumberValue(-5);
+    try std.testing.expect(support.supIsNumber(n));
+    try std.testing.expectEqual(@as(i64, -5), support.supNumber(n));
+    try std.testing.expectEqual(&support.type_number, support.supType(n));
+
+    var lambda_type = support.ManagedType{ .name = "test", .func = null };
+    support.supPushLambda(&lambda_type);
+    try std.testing.expect(!support.supIsNumber(support.runtime.top));
+    try std.testing.expectEqual(&lambda_type, support.supType(support.runtime.top));
+    support.supStackDrop();
+    support.supPushClosure(&lambda_type, 1);
+    try std.testing.expectEqual(&lambda_type, support.supType(support.runtime.top));
+    support.supStackDrop();
+    support.supPushString("s");
+    try std.testing.expect(support.supIsString(support.runtime.top));
+    try std.testing.expectEqual(&support.type_string, support.supType(support.runtime.top));
+    support.supStackDrop();
+}
+
+test "put-str is buffered" {
+    support.supRuntimeInit();
+    support.supPushString("buffered");
+    support.supPushLambda(&support.sup_builtin_put_string);
+    support.supCall(1);
+    try std.testing.expectEqual(@as(i64, 8), support.supNumber(support.runtime.top));
+    try std.testing.expectEqualStrings("buffered\n", support.runtime.output[0..support.runtime.output_len]);
+    // The test runner talks to the build system over stdout.
+    support.runtime.output_len = 0;
+    support.supStackDrop();
+}
+
+/// Keeps a profiled call busy for long enough to take some ticks.
+fn testSpin() void {
+    var x: u64 = 0;
+    for (0..10000) |i| {
+        x +%= i;
+        std.mem.doNotOptimizeAway(x);
+    }
+}
+
+test "profile folds direct recursion" {
+    support.supRuntimeInit();
+    var outer = std.mem.zeroes(support.SupProfileSite);
+    outer.name = "outer";
+    outer.location = "test:1";
+    var inner = std.mem.zeroes(support.SupProfileSite);
+    inner.name = "inner";
+    inner.location = "test:2";
+    var frames: [3]support.SupProfileFrame = undefined;
+    support.supProfileEnter(&frames[0], &outer);
+    testSpin();
+    support.supProfileEnter(&frames[1], &inner);
+    testSpin();
+    support.supProfileEnter(&frames[2], &inner);
+    testSpin();
+    support.supProfileExit(&frames[2]);
+    support.supProfileExit(&frames[1]);
+    support.supProfileExit(&frames[0]);
+
+    try std.testing.expectEqual(@as(u64, 1), outer.calls);
+    try std.testing.expectEqual(@as(u64, 2), inner.calls);
+    try std.testing.expectEqual(@as(u64, 0), inner.active);
+    try std.testing.expect(outer.self_ticks <= outer.total_ticks);
+    try std.testing.expect(inner.self_ticks <= inner.total_ticks);
+    try std.testing.expect(inner.total_ticks <= outer.total_ticks);
+
+    var tmp = std.testing.tmpDir(.{});
+    defer tmp.cleanup();
+    var dir = try tmp.dir.realpathAlloc(std.testing.allocator, ".");
+    defer std.testing.allocator.free(dir);
+    var path = try std.fs.path.joinZ(std.testing.allocator, &.{ dir, "profile.folded" });
+    defer std.testing.allocator.free(path);
+    support.supProfileWrite(path);
+    var folded = try tmp.dir.readFileAlloc(std.testing.allocator, "profile.folded", 1 << 16);
+    defer std.testing.allocator.free(folded);
+
+    // The recursive call of inner stays in the node of the first one.
+    var lines = std.mem.tokenizeScalar(u8, folded, '\n');
+    for ([_][]const u8{ "outer (test:1)", "outer (test:1);inner (test:2)" }) |expected| {
+        var line = lines.next() orelse return error.TestExpectedEqual;
+        var stack_end = std.mem.lastIndexOfScalar(u8, line, ' ').?;
+        try std.testing.expectEqualStrings(expected, line[0..stack_end]);
+        try std.testing.expect(try std.fmt.parseInt(u64, line[stack_end + 1 ..], 10) > 0);
+    }
+    try std.testing.expectEqual(@as(?[]const u8, null), lines.next());
+
+    // Writing the profile ends the calls a fatal error left open.
+    var total_ticks = outer.total_ticks;
+    support.supProfileEnter(&frames[0], &outer);
+    testSpin();
+    support.supProfileWrite(path);
+    try std.testing.expectEqual(@as(u64, 0), outer.active);
+    try std.testing.expect(outer.total_ticks > total_ticks);
+}